@@ -0,0 +1,56 @@
+# Shared by the bench/*.sh drivers, sourced from the top of the repo.
+#   YASH        yash binary to measure (./yash)
+#   BENCH_DIR   where workloads and data files are generated (/tmp/yash-bench)
+#   BENCH_RUNS  runs per measurement, the best one is reported (3)
+set -e
+yash=${YASH:-./yash}
+dir=${BENCH_DIR:-/tmp/yash-bench}
+runs=${BENCH_RUNS:-3}
+mkdir -p "$dir"
+
+# now: wall clock in ns
+now() {
+  date +%s%N
+}
+
+# ms CMD...: run CMD with its stdout discarded, print the wall time in ms
+ms() {
+  t0=$(now)
+  "$@" > /dev/null
+  echo $((($(now) - t0) / 1000000))
+}
+
+# best CMD...: the fastest of BENCH_RUNS runs of CMD, in ms (at least 1)
+best() {
+  b=
+  i=0
+  while [ $i -lt "$runs" ]; do
+    t=$(ms "$@")
+    if [ -z "$b" ] || [ "$t" -lt "$b" ]; then
+      b=$t
+    fi
+    i=$((i + 1))
+  done
+  echo $((b > 0 ? b : 1))
+}
+
+# mbps BYTES MS: throughput in MB/s
+mbps() {
+  echo $(($1 * 1000 / $2 / 1048576))
+}
+
+# corpus MB: print the path of a MB megabyte text file made of copies of
+# 1.txt, generated on first use
+corpus() {
+  f=$dir/corpus-${1}m
+  if [ ! -s "$f" ]; then
+    cp 1.txt "$f.tmp"
+    while [ "$(stat -c %s "$f.tmp")" -lt $(($1 << 20)) ]; do
+      cat "$f.tmp" "$f.tmp" > "$f.tmp2"
+      mv "$f.tmp2" "$f.tmp"
+    done
+    truncate -s $(($1 << 20)) "$f.tmp"
+    mv "$f.tmp" "$f"
+  fi
+  echo "$f"
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# cat and cp throughput: the builtins (copy_file_range, splice, sendfile)
+# against /bin/cat and /bin/cp on a BENCH_COPY_MB file. Set it past the
+# page cache to measure the disk rather than memory.
+#   BENCH_COPY_MB  file size (2048)
+. bench/common.sh
+mb=${BENCH_COPY_MB:-2048}
+data=$(corpus "$mb")
+out=$dir/copy-out
+
+# compare NAME BUILTIN TOOLS: time the builtin line and the same with the
+# coreutils tools, print one result row
+compare() {
+  name=$1
+  echo "$2" > "$dir/copy-builtin"
+  echo "$3" > "$dir/copy-tools"
+  builtin=$(best "$yash" "$dir/copy-builtin")
+  tools=$(best "$yash" "$dir/copy-tools")
+  rm -f "$out"
+  echo "copy: $name $(mbps $((mb << 20)) "$builtin") $(mbps $((mb << 20)) "$tools")"
+}
+
+echo "copy: case, builtin MB/s, coreutils MB/s ($mb MB)"
+compare "file>file" "cat $data > $out" "/bin/cat $data > $out"
+compare "cp" "cp $data $out" "/bin/cp $data $out"
+compare "file|pipe" "cat $data | /bin/cat > /dev/null" \
+  "/bin/cat $data | /bin/cat > /dev/null"
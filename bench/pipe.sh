@@ -0,0 +1,27 @@
+#!/bin/sh
+# Pipeline throughput: BENCH_MB of text through k /bin/cat stages, with
+# the kernel's pipe size and with 'set -o pipesize=1m', next to sh running
+# the same pipeline.
+#   BENCH_MB      data size (256)
+#   BENCH_STAGES  stage counts to try (1 2 4 10)
+. bench/common.sh
+mb=${BENCH_MB:-256}
+data=$(corpus "$mb")
+
+echo "pipe: stages, default MB/s, pipesize=1m MB/s, sh MB/s"
+for k in ${BENCH_STAGES:-1 2 4 10}; do
+  line="/bin/cat $data"
+  i=1
+  while [ $i -lt "$k" ]; do
+    line="$line | /bin/cat"
+    i=$((i + 1))
+  done
+  line="$line > /dev/null"
+  echo "$line" > "$dir/pipe-$k"
+  printf 'set -o pipesize=1m\n%s\n' "$line" > "$dir/pipe-$k-1m"
+  plain=$(best "$yash" "$dir/pipe-$k")
+  big=$(best "$yash" "$dir/pipe-$k-1m")
+  sh=$(best sh "$dir/pipe-$k")
+  echo "pipe: $k $(mbps $((mb << 20)) "$plain") $(mbps $((mb << 20)) "$big")" \
+    "$(mbps $((mb << 20)) "$sh")"
+done
@@ -0,0 +1,26 @@
+#!/bin/sh
+# '@N' replica scaling: a CPU-bound awk over BENCH_MB of text, as a plain
+# stage and as '@k awk' for k = 1, 2, 4, ... up to the online CPUs.
+#   BENCH_MB  data size (64)
+. bench/common.sh
+mb=${BENCH_MB:-64}
+data=$(corpus "$mb")
+cpus=$(nproc)
+prog='{ for (i = 0; i < 20; i++) n += length($0) * i } END { print n }'
+
+echo "cat $data | awk '$prog' > /dev/null" > "$dir/replicas-plain"
+plain=$(best "$yash" "$dir/replicas-plain")
+echo "replicas: copies, ms, MB/s, speedup over plain awk ($cpus CPUs)"
+echo "replicas: plain $plain $(mbps $((mb << 20)) "$plain") 1.00x"
+k=1
+while :; do
+  echo "cat $data | @$k awk '$prog' > /dev/null" > "$dir/replicas-$k"
+  t=$(best "$yash" "$dir/replicas-$k")
+  r=$((plain * 100 / t))
+  printf 'replicas: %s %s %s %d.%02dx\n' "$k" "$t" \
+    "$(mbps $((mb << 20)) "$t")" $((r / 100)) $((r % 100))
+  if [ $k -ge "$cpus" ] && [ $k -ge 2 ]; then
+    break
+  fi
+  k=$((k * 2 < cpus || k < 2 ? k * 2 : cpus))
+done
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Word scanner: lines of 100 B to 2 MB through 'yash script', with the
+# SIMD scanner picked for this CPU (yash) and the scalar one (yash-scalar).
+# Lines are either 16 byte words or one word as long as the line. Every
+# line is new to the plan cache, so each one is tokenized.
+#   BENCH_SCAN_MB  script bytes per line size and word length (16)
+. bench/common.sh
+scalar=${YASH_SCALAR:-./yash-scalar}
+total=$((${BENCH_SCAN_MB:-16} << 20))
+
+echo "scan: line bytes, word bytes, simd MB/s, scalar MB/s, speedup"
+for size in 100 1000 10000 100000 1000000 2000000; do
+  for word in 16 $size; do
+    script=$dir/scan-$size-$word
+    awk -v size="$size" -v word="$word" -v n=$((total / size)) 'BEGIN {
+      pad = "abcdefghijklmno"
+      if (word < size)
+        pad = " " pad
+      while (length(pad) < size)
+        pad = pad pad
+      for (i = 1; i <= n || i == 1; i++) {
+        line = "true " i
+        print line substr(pad, 1, size - length(line) - 1)
+      }
+    }' > "$script"
+    bytes=$(stat -c %s "$script")
+    simd=$(best "$yash" "$script")
+    base=$(best "$scalar" "$script")
+    r=$((base * 100 / simd))
+    printf 'scan: %s %s %s %s %d.%02dx\n' "$size" "$word" \
+      "$(mbps "$bytes" "$simd")" "$(mbps "$bytes" "$base")" \
+      $((r / 100)) $((r % 100))
+  done
+done
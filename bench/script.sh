@@ -0,0 +1,26 @@
+#!/bin/sh
+# Script mode: a BENCH_LINES line script of 'true && echo line N > /dev/null'
+# run as 'yash script', as 'yash < script', piped into yash, and by sh.
+#   BENCH_LINES  script length (100000)
+. bench/common.sh
+n=${BENCH_LINES:-100000}
+script=$dir/script-$n
+awk -v n="$n" 'BEGIN {
+  for (i = 1; i <= n; i++)
+    print "true && echo line " i " > /dev/null"
+}' > "$script"
+
+# lps MS: lines per second
+lps() {
+  echo $((n * 1000 / $1))
+}
+
+file=$(best "$yash" "$script")
+stdin=$(best sh -c "\"\$0\" < \"\$1\"" "$yash" "$script")
+piped=$(best sh -c "cat \"\$1\" | \"\$0\"" "$yash" "$script")
+sh=$(best sh "$script")
+echo "script: how, lines/s ($n lines)"
+echo "script: 'yash script' $(lps "$file")"
+echo "script: 'yash < script' $(lps "$stdin")"
+echo "script: 'cat script | yash' $(lps "$piped")"
+echo "script: 'sh script' $(lps "$sh")"
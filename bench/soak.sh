@@ -0,0 +1,49 @@
+#!/bin/sh
+# Soak test: run SOAK_LINES commands (default 1M) through 'yash script' and
+# check that yash's RSS stays flat. Built with -DLEAK_CHECK, yash runs
+# LeakSanitizer before exiting and fails if anything leaked.
+#
+#   sh bench/soak.sh [yash binary]
+set -e
+yash=${1:-./yash-lsan}
+lines=${SOAK_LINES:-1000000}
+slack=${SOAK_SLACK_KB:-1024}  # allowed growth after the first sample
+dir=$(mktemp -d /tmp/yash-soak.XXXXXX)
+trap 'rm -rf "$dir"' EXIT
+
+# Mostly in-process builtins with distinct text, so the plan cache keeps
+# evicting. Every 1000th line spawns a pipeline or a background job. Every
+# 10th of the run, sh appends yash's VmRSS to the log ($PPID is yash).
+awk -v n="$lines" -v out="$dir/rss" 'BEGIN {
+  for (i = 1; i <= n; i++) {
+    if (i % (n / 10) == 0)
+      print "sh -c '\''grep VmRSS /proc/$PPID/status >> " out "'\''"
+    else if (i % 1000 == 0)
+      print "/bin/true | /bin/true | /bin/true"
+    else if (i % 1000 == 500)
+      print "/bin/true & wait"
+    else if (i % 4 == 0)
+      print "echo " i " a \"b c\" > /dev/null"
+    else if (i % 4 == 1)
+      print "true && false || echo " i " > /dev/null"
+    else if (i % 4 == 2)
+      print "{ echo x; pwd; } > /dev/null"
+    else
+      print "export SOAK=" i % 64
+  }
+}' > "$dir/script"
+
+start=$(date +%s)
+"$yash" "$dir/script" > /dev/null
+echo "soak: $lines lines in $(($(date +%s) - start))s, no leaks"
+
+awk -v slack="$slack" '
+  { rss[NR] = $2 }
+  END {
+    growth = rss[NR] - rss[1]
+    printf "soak: VmRSS %d kB -> %d kB over %d samples\n", rss[1], rss[NR], NR
+    if (NR < 2 || growth > slack) {
+      printf "soak: FAIL, RSS grew by %d kB (slack %d kB)\n", growth, slack
+      exit 1
+    }
+  }' "$dir/rss"
@@ -0,0 +1,40 @@
+#!/bin/sh
+# Launch latency against heap size: the heap is grown by filling the plan
+# cache with 512 distinct long lines, then N external commands are started
+# with posix_spawn (/bin/true) and through a forked copy of the shell
+# (( /bin/true ), a subshell). The time of a fill-only script is subtracted.
+#   BENCH_HEAP_MB  heap sizes to try (0 16 64 256)
+#   BENCH_SPAWNS   commands per measurement (2000)
+. bench/common.sh
+n=${BENCH_SPAWNS:-2000}
+
+# fill MB: a script that leaves MB megabytes of line text in cached plans
+fill() {
+  awk -v size=$(($1 * 2048)) 'BEGIN {
+    pad = "abcdefghijklmnop"
+    while (length(pad) < size)
+      pad = pad pad
+    for (i = 1; size && i <= 512; i++)
+      print "true " i " " substr(pad, 1, size)
+  }'
+}
+
+echo "spawn: plans MB, VmRSS kB, posix_spawn us, fork us"
+for mb in ${BENCH_HEAP_MB:-0 16 64 256}; do
+  base=$dir/spawn-$mb
+  fill "$mb" > "$base-fill"
+  echo "sh -c 'grep VmRSS /proc/\$PPID/status'" >> "$base-fill"
+  for kind in spawn fork; do
+    cp "$base-fill" "$base-$kind"
+    awk -v n="$n" -v kind=$kind 'BEGIN {
+      for (i = 0; i < n; i++)
+        print kind == "spawn" ? "/bin/true" : "( /bin/true )"
+    }' >> "$base-$kind"
+  done
+  rss=$("$yash" "$base-fill" | awk '{ print $2 }')
+  idle=$(best "$yash" "$base-fill")
+  spawn=$(best "$yash" "$base-spawn")
+  fork=$(best "$yash" "$base-fork")
+  echo "spawn: $mb $rss $(((spawn - idle) * 1000 / n))" \
+    "$(((fork - idle) * 1000 / n))"
+done
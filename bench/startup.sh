@@ -0,0 +1,44 @@
+#!/bin/sh
+# 'yash -c' startup against dash: the first run, then the mean of
+# BENCH_STARTS runs. When the page cache can be dropped (root), the first
+# run is a cold start; otherwise it only comes after the binaries were idle.
+#   BENCH_STARTS  runs per measurement (500)
+. bench/common.sh
+n=${BENCH_STARTS:-500}
+dash=$(command -v dash || echo sh)
+
+# loop SHELL CMD: run 'SHELL -c CMD' n times
+loop() {
+  i=0
+  while [ $i -lt "$n" ]; do
+    "$1" -c "$2"
+    i=$((i + 1))
+  done
+}
+
+# drop: drop the page cache if allowed, so the next run starts cold
+drop() {
+  sync
+  echo 3 2> /dev/null > /proc/sys/vm/drop_caches
+}
+
+# first SHELL CMD: one run in us, right after drop
+first() {
+  drop || true
+  t0=$(now)
+  "$1" -c "$2" > /dev/null
+  echo $((($(now) - t0) / 1000))
+}
+
+label=first
+if drop; then
+  label=cold
+fi
+echo "startup: command, $label run us, us per run after it"
+for shell in "$yash" "$dash"; do
+  for cmd in true /bin/true; do
+    one=$(first "$shell" "$cmd")
+    all=$(best loop "$shell" "$cmd")
+    echo "startup: '$shell -c $cmd' $one $((all * 1000 / n))"
+  done
+done
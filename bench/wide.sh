@@ -0,0 +1,24 @@
+#!/bin/sh
+# Wide pipeline startup: pipelines of 2, 8 and 32 /bin/true stages, with
+# the launcher pool (yash) and with every stage spawned by the shell
+# thread (yash-seq), next to sh.
+#   BENCH_PIPELINES  pipelines per measurement (200)
+. bench/common.sh
+seq=${YASH_SEQ:-./yash-seq}
+n=${BENCH_PIPELINES:-200}
+
+echo "wide: stages, parallel us, sequential us, sh us per pipeline"
+for k in 2 8 32; do
+  script=$dir/wide-$k
+  awk -v k="$k" -v n="$n" 'BEGIN {
+    line = "/bin/true"
+    for (i = 1; i < k; i++)
+      line = line " | /bin/true"
+    for (i = 0; i < n; i++)
+      print line
+  }' > "$script"
+  par=$(best "$yash" "$script")
+  one=$(best "$seq" "$script")
+  sh=$(best sh "$script")
+  echo "wide: $k $((par * 1000 / n)) $((one * 1000 / n)) $((sh * 1000 / n))"
+done
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <fcntl.h>
 #include <readline/readline.h>
 #include <stdbool.h>
@@ -6,272 +7,327 @@
 #include "stdlib.h"
 #include "string.h"
 
+/*A command only records where its pieces are: argv entries are a run of
+offsets in the job's offset table and redirection targets are offsets into the
+job's token text. -1 means no redirection*/
 typedef struct Commands {
-  char* command;
-  bool isCommand;
-  int inputIndex;
-  int outIndex;
-  int errIndex;
-  char* arguments[2000];
-  char* tokenCommand[2000];
+  int argStart;
   int numArgs;
-  int numTokens;
-  bool hasInput;
-  char* inputFile;
-  bool hasOut;
-  char* outFile;
-  bool hasErr;
-  char* errFile;
+  int inputFile;
+  int outFile;
+  int errFile;
 } Commands;
 
+/*One allocation per job, laid out as
+[ offset table | original line (+2 spare for " &") | token text ]*/
 typedef struct Jobs {
   Commands comms[2];
   int numCom;
+  char* block;
+  int* offsets;
   char* str;
+  char* text;
   bool fg;
   bool bg;
   bool hasPipe;
   pid_t pgid;
+  int liveProcs;
   int jobNumber;
   bool stop;
   bool interr;
   bool finished;
 } Jobs;
 
-Jobs jobs[20] = {NULL};
-int currentJob = 0;
-int nextJob = 0;
+/*Jobs live in a slab: fixed size chunks that are never moved, so a Jobs*
+stays valid while the table grows. Free slots are chained in a free list and
+live ones in a list kept in job number order. A handle carries the slot's
+generation, which is bumped on every free, so a stale handle is detected
+instead of silently pointing at whatever job reused the slot*/
+#define SLAB_CHUNK 64
+
+typedef struct JobHandle {
+  int index;
+  unsigned int generation;
+} JobHandle;
+
+typedef struct JobSlot {
+  Jobs job;
+  unsigned int generation;
+  bool inUse;
+  int nextFree;
+  int prevLive;
+  int nextLive;
+} JobSlot;
+
+JobSlot** slabChunks = NULL;
+int numChunks = 0;
+int numSlots = 0;
+int freeList = -1;
+int liveHead = -1;
+int liveTail = -1;
+int liveCount = 0;
+
+const JobHandle noJob = {-1, 0};
+JobHandle currentJob = {-1, 0};
+JobHandle plusJob = {-1, 0};
 int jobNumber = 0;
 pid_t currPgid = 0;
 
+JobSlot* slotAt(int index) {
+  return &slabChunks[index / SLAB_CHUNK][index % SLAB_CHUNK];
+}
+
+JobHandle handleAt(int index) {
+  JobHandle handle = {index, slotAt(index)->generation};
+  return handle;
+}
+
+Jobs* getJob(JobHandle handle) {
+  if (handle.index < 0 || handle.index >= numSlots)
+    return NULL;
+  JobSlot* slot = slotAt(handle.index);
+  if (!slot->inUse || slot->generation != handle.generation)
+    return NULL;
+  return &slot->job;
+}
+
+JobHandle allocJob() {
+  if (freeList == -1) {
+    // out of slots: add a chunk, the existing ones stay where they are
+    slabChunks = realloc(slabChunks, (numChunks + 1) * sizeof(JobSlot*));
+    slabChunks[numChunks] = calloc(SLAB_CHUNK, sizeof(JobSlot));
+    for (int i = SLAB_CHUNK - 1; i >= 0; i--) {
+      slabChunks[numChunks][i].nextFree = freeList;
+      freeList = numSlots + i;
+    }
+    numChunks++;
+    numSlots += SLAB_CHUNK;
+  }
+  int index = freeList;
+  JobSlot* slot = slotAt(index);
+  freeList = slot->nextFree;
+  slot->inUse = true;
+  memset(&slot->job, 0, sizeof(Jobs));
+
+  slot->prevLive = liveTail;
+  slot->nextLive = -1;
+  if (liveTail != -1)
+    slotAt(liveTail)->nextLive = index;
+  else
+    liveHead = index;
+  liveTail = index;
+  liveCount++;
+  return handleAt(index);
+}
+
+void setPlusJob(JobHandle handle) {
+  Jobs* old = getJob(plusJob);
+  if (old)
+    old->fg = false;
+  plusJob = handle;
+  Jobs* job = getJob(handle);
+  if (job)
+    job->fg = true;
+}
+
+void freeCommands(Jobs* job) {
+  free(job->block);
+}
+
+void releaseJob(JobHandle handle) {
+  Jobs* job = getJob(handle);
+  if (!job)
+    return;
+  freeCommands(job);
+  if (plusJob.index == handle.index)
+    plusJob = noJob;
+
+  JobSlot* slot = slotAt(handle.index);
+  if (slot->prevLive != -1)
+    slotAt(slot->prevLive)->nextLive = slot->nextLive;
+  else
+    liveHead = slot->nextLive;
+  if (slot->nextLive != -1)
+    slotAt(slot->nextLive)->prevLive = slot->prevLive;
+  else
+    liveTail = slot->prevLive;
+  liveCount--;
+
+  slot->inUse = false;
+  slot->generation++;
+  slot->nextFree = freeList;
+  freeList = handle.index;
+
+  // job numbers stay stable, new ones continue after the newest live job
+  jobNumber = (liveTail != -1) ? slotAt(liveTail)->job.jobNumber : 0;
+}
+
 void sigHandler(int signum) {
+  Jobs* job = getJob(currentJob);
   if (signum == SIGTSTP) {
-    if (currPgid != 0 && jobs[currentJob].bg == false) {
+    if (currPgid != 0 && job && job->bg == false) {
       kill((-1 * currPgid), SIGTSTP);
-      for (int i = 0; i < 20; i++)
-        jobs[i].fg = false;
-      jobs[currentJob].fg = true;
-      jobs[currentJob].stop = true;
+      setPlusJob(currentJob);
+      job->stop = true;
     }
   } else if (signum == SIGINT) {
-    if (currPgid != 0 && jobs[currentJob].bg == false)
-      jobs[currentJob].interr = true;
+    if (currPgid != 0 && job && job->bg == false)
+      job->interr = true;
     kill((-1 * currPgid), SIGINT);
   }
 }
 
-void fgJob() {
+/*Collects exits and stops of a job's processes. Non-blocking calls only take
+what is already there, so background jobs are checked at each prompt without
+ever spinning. Blocking calls return once every process exited or one
+stopped*/
+void waitJob(Jobs* job, bool block) {
   int status;
-  int jobsIdx;
-  for (jobsIdx = 0; jobsIdx < 20; jobsIdx++) {
-    if (jobs[jobsIdx].fg) {
-      currentJob = jobsIdx;
-      currPgid = jobs[jobsIdx].pgid;
-      jobs[jobsIdx].stop = false;
-      jobs[jobsIdx].bg = false;
-      if (jobs[jobsIdx].str[strlen(jobs[jobsIdx].str) - 1] == '&')
-        jobs[jobsIdx].str[strlen(jobs[jobsIdx].str) - 1] = '\0';
-      printf("%s\n", jobs[jobsIdx].str);
-      kill(-1 * (jobs[jobsIdx].pgid), SIGCONT);
+  int options = block ? WUNTRACED : WNOHANG | WUNTRACED;
+  while (job->liveProcs > 0) {
+    int ret = waitpid(-1 * job->pgid, &status, options);
+    if (ret == 0)
       break;
-    }
-  }
-  waitpid(jobs[currentJob].pgid, &status, WUNTRACED);
-  if (WIFEXITED(status)) {
-    jobs[currentJob].finished = true;
-  } else if (WIFSTOPPED(status)) {
-    if (WSTOPSIG(status) == SIGTSTP)
-      jobs[currentJob].stop = true;
-    else if (WSTOPSIG(status) == SIGINT)
-      jobs[currentJob].interr = true;
-  }
-}
-
-void bgJob() {
-  int status;
-  int jobsIdx;
-  for (jobsIdx = 0; jobsIdx < 20; jobsIdx++) {
-    if (jobs[jobsIdx].fg && jobs[jobsIdx].bg == false) {
-      if (jobsIdx > 0)
-        jobs[jobsIdx - 1].fg = false;
-      currentJob = jobsIdx;
-      jobs[jobsIdx].stop = false;
-      currPgid = jobs[jobsIdx].pgid;
-      jobs[jobsIdx].bg = true;
-
-      strcat(jobs[jobsIdx].str, " &");
-      printf("[%d]+ %s\n", jobs[jobsIdx].jobNumber, jobs[jobsIdx].str);
-      kill(-1 * (jobs[jobsIdx].pgid), SIGCONT);
+    if (ret == -1) {
+      if (errno == EINTR)
+        continue;
+      job->liveProcs = 0;  // nothing left in the group to wait for
       break;
     }
-  }
-  waitpid(jobs[currentJob].pgid, &status, WNOHANG);
-}
-
-void leftShiftJobs() {
-  for (int i = 0; i < 20; i++) {
-    // empty pos when pgid == 1
-    if (jobs[i].pgid == 1) {
-      int nearestFullElement;
-      for (nearestFullElement = i; nearestFullElement < 19;
-           nearestFullElement++) {
-        if (jobs[nearestFullElement].pgid != 1)
-          break;
-      }
-      jobs[i] = jobs[nearestFullElement];
-      jobs[nearestFullElement].pgid = 1;
-    }
-  }
-  if (jobs[0].pgid == 1) {
-    nextJob = 0;
-    currentJob = 0;
-    jobNumber = 0;
-  } else {
-    int jobsIdx;
-    for (jobsIdx = 1; jobsIdx < 20; jobsIdx++) {
-      if (jobs[jobsIdx].pgid == 1)
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      job->liveProcs--;
+    } else if (WIFSTOPPED(status)) {
+      if (WSTOPSIG(status) == SIGTSTP)
+        job->stop = true;
+      else if (WSTOPSIG(status) == SIGINT)
+        job->interr = true;
+      if (block)
         break;
     }
-    int maxJobNumber = -1;
-    for (int i = 0; i < 20; i++) {
-      if (jobs[i].jobNumber > maxJobNumber)
-        maxJobNumber = jobs[i].jobNumber;
-    }
-    jobNumber = maxJobNumber;
-    nextJob = jobsIdx;
-    currentJob = jobsIdx - 1;
   }
+  if (job->liveProcs == 0)
+    job->finished = true;
 }
 
-void freeJobs(const int* arr) {
-  for (int arrInd = 0; arrInd < 20; arrInd++) {
-    if (arr[arrInd] != -1) {
-      for (int i = 0; i < jobs[arr[arrInd]].numCom; i++) {
-        free(jobs[arr[arrInd]].comms[i].command);
-        if (jobs[arr[arrInd]].comms[i].arguments > 0) {
-          for (int j = 0; j < jobs[arr[arrInd]].comms[i].numArgs; j++) {
-            free(jobs[arr[arrInd]].comms[i].arguments[j]);
-          }
-        }
-        if (jobs[arr[arrInd]].comms[i].hasInput) {
-          free(jobs[arr[arrInd]].comms[i].inputFile);
-          jobs[arr[arrInd]].comms[i].hasInput = false;
-        }
-        if (jobs[arr[arrInd]].comms[i].hasOut) {
-          free(jobs[arr[arrInd]].comms[i].outFile);
-          jobs[arr[arrInd]].comms[i].hasOut = false;
-        }
-        if (jobs[arr[arrInd]].comms[i].hasErr) {
-          free(jobs[arr[arrInd]].comms[i].errFile);
-          jobs[arr[arrInd]].comms[i].hasErr = false;
-        }
-        jobs[arr[arrInd]].hasPipe = false;
-        for (int j = 0; jobs[arr[arrInd]].comms[i].numArgs; j++) {
-          jobs[arr[arrInd]].comms[i].arguments[j] = (char*)NULL;
-        }
-      }
-      free(jobs[arr[arr[arrInd]]].str);
-      jobs[arr[arrInd]].fg = false;
-      jobs[arr[arrInd]].bg = false;
-      jobs[arr[arrInd]].pgid = 1;
-      jobs[arr[arrInd]].jobNumber = 0;
-      jobs[arr[arrInd]].interr = false;
-      jobs[arr[arrInd]].stop = false;
-      jobs[arr[arrInd]].finished = false;
-    }
+void fgJob() {
+  Jobs* job = getJob(plusJob);
+  if (!job)
+    return;
+  currentJob = plusJob;
+  currPgid = job->pgid;
+  job->stop = false;
+  job->bg = false;
+  // drop the whole " &", so a bg/fg cycle never grows str past its spare
+  size_t len = strlen(job->str);
+  if (len > 0 && job->str[len - 1] == '&') {
+    len--;
+    while (len > 0 && job->str[len - 1] == ' ')
+      len--;
+    job->str[len] = '\0';
   }
-  leftShiftJobs();
+  printf("%s\n", job->str);
+  kill(-1 * (job->pgid), SIGCONT);
+  waitJob(job, true);
+}
+
+void bgJob() {
+  Jobs* job = getJob(plusJob);
+  if (!job || job->bg)
+    return;
+  currentJob = plusJob;
+  job->stop = false;
+  currPgid = job->pgid;
+  job->bg = true;
+
+  strcat(job->str, " &");  // block keeps 2 spare bytes after str
+  printf("[%d]+ %s\n", job->jobNumber, job->str);
+  kill(-1 * (job->pgid), SIGCONT);
 }
 
 void accessJobs() {
-  int finishedJobs[20];
-  for (int i = 0; i < 20; i++)
-    finishedJobs[i] = -1;
+  JobHandle* finishedJobs = malloc((liveCount + 1) * sizeof(JobHandle));
   int finishedJobsIdx = 0;
-  for (int jobsIdx = 0; jobsIdx < 20; jobsIdx++) {
-    if (jobs[jobsIdx].finished) {
-      finishedJobs[finishedJobsIdx] = jobsIdx;
-      finishedJobsIdx++;
-    }
-    if (jobs[jobsIdx].bg) {
-      int status;
-      int ret = waitpid(-1 * jobs[jobsIdx].pgid, &status, WNOHANG | WUNTRACED);
-      if (ret != 0 && WIFEXITED(status) && ret != -1) {
+  for (int i = liveHead; i != -1; i = slotAt(i)->nextLive) {
+    Jobs* job = &slotAt(i)->job;
+    if (job->finished) {
+      finishedJobs[finishedJobsIdx++] = handleAt(i);
+    } else if (job->bg) {
+      waitJob(job, false);
+      if (job->finished) {
         // most recent command
-        if (jobs[jobsIdx].fg)
-          printf("[%d]+ Done %s\n", jobs[jobsIdx].jobNumber, jobs[jobsIdx].str);
+        if (job->fg)
+          printf("[%d]+ Done %s\n", job->jobNumber, job->str);
         else
-          printf("[%d]- Done %s\n", jobs[jobsIdx].jobNumber, jobs[jobsIdx].str);
-        jobs[jobsIdx].finished = true;
-        finishedJobs[finishedJobsIdx] = jobsIdx;
-        finishedJobsIdx++;
+          printf("[%d]- Done %s\n", job->jobNumber, job->str);
+        finishedJobs[finishedJobsIdx++] = handleAt(i);
       }
     }
   }
 
-  freeJobs(finishedJobs);
-
-  if (jobs[currentJob].bg == true) {
-    int i = currentJob;
-    while (jobs[i].bg == true && i > 0) {
-      jobs[i].fg = false;
-      i--;
+  for (int i = 0; i < finishedJobsIdx; i++)
+    releaseJob(finishedJobs[i]);
+  free(finishedJobs);
+
+  if (!getJob(currentJob))
+    currentJob = (liveTail != -1) ? handleAt(liveTail) : noJob;
+  Jobs* job = getJob(currentJob);
+  if (!job)
+    return;
+  if (job->bg == true) {
+    // '+' goes to the newest job that is not running in the background
+    int i = currentJob.index;
+    while (slotAt(i)->job.bg == true && slotAt(i)->prevLive != -1) {
+      if (plusJob.index == i)
+        setPlusJob(noJob);
+      i = slotAt(i)->prevLive;
     }
-    if (jobs[i].bg == false)
-      jobs[i].fg = true;
+    if (slotAt(i)->job.bg == false)
+      setPlusJob(handleAt(i));
   } else {
-    for (int i = 0; i < 20; i++) {
-      jobs[i].fg = false;
-    }
-    jobs[currentJob].fg = true;
+    setPlusJob(currentJob);
   }
 }
 
 void printJobs() {
-  int interruptedJobs[20];
+  JobHandle* interruptedJobs = malloc((liveCount + 1) * sizeof(JobHandle));
   int interruptedJobsIdx = 0;
-  for (int i = 0; i < 20; i++)
-    interruptedJobs[i] = -1;
-  for (int jobsIdx = 0; jobsIdx < 20; jobsIdx++) {
-    if (jobs[jobsIdx].pgid != 1) {
-      if (jobs[jobsIdx].stop == true) {
-        if (jobs[jobsIdx].fg)
-          printf("[%d] + Stopped %s\n", jobs[jobsIdx].jobNumber,
-                 jobs[jobsIdx].str);
-        else
-          printf("[%d] - Stopped %s\n", jobs[jobsIdx].jobNumber,
-                 jobs[jobsIdx].str);
-      } else if (jobs[jobsIdx].interr == true) {
-        interruptedJobs[interruptedJobsIdx] = jobsIdx;
-        interruptedJobsIdx++;
-      } else if (jobs[jobsIdx].finished != true) {
-        if (jobs[jobsIdx].fg)
-          printf("[%d] + Running %s\n", jobs[jobsIdx].jobNumber,
-                 jobs[jobsIdx].str);
-        else
-          printf("[%d] - Running %s\n", jobs[jobsIdx].jobNumber,
-                 jobs[jobsIdx].str);
-      }
+  for (int i = liveHead; i != -1; i = slotAt(i)->nextLive) {
+    Jobs* job = &slotAt(i)->job;
+    if (job->stop == true) {
+      if (job->fg)
+        printf("[%d] + Stopped %s\n", job->jobNumber, job->str);
+      else
+        printf("[%d] - Stopped %s\n", job->jobNumber, job->str);
+    } else if (job->interr == true) {
+      interruptedJobs[interruptedJobsIdx++] = handleAt(i);
+    } else if (job->finished != true) {
+      if (job->fg)
+        printf("[%d] + Running %s\n", job->jobNumber, job->str);
+      else
+        printf("[%d] - Running %s\n", job->jobNumber, job->str);
     }
   }
-  freeJobs(interruptedJobs);
+  for (int i = 0; i < interruptedJobsIdx; i++)
+    releaseJob(interruptedJobs[i]);
+  free(interruptedJobs);
 }
 
 void redirect(int index) {
-  if (jobs[currentJob].comms[index].hasInput) {
+  Jobs* job = getJob(currentJob);
+  if (job->comms[index].inputFile != -1) {
     int fd_in =
-        open(jobs[currentJob].comms[index].inputFile, O_CREAT | O_RDONLY);
+        open(job->text + job->comms[index].inputFile, O_CREAT | O_RDONLY);
     dup2(fd_in, STDIN_FILENO);
     close(fd_in);
   }
-  if (jobs[currentJob].comms[index].hasOut) {
+  if (job->comms[index].outFile != -1) {
     int fd_out =
-        open(jobs[currentJob].comms[index].outFile, O_CREAT | O_WRONLY, 0777);
+        open(job->text + job->comms[index].outFile, O_CREAT | O_WRONLY, 0777);
     dup2(fd_out, STDOUT_FILENO);
     close(fd_out);
   }
-  if (jobs[currentJob].comms[index].hasErr) {
-    int fd = creat(jobs[currentJob].comms[index].errFile, 0644);
+  if (job->comms[index].errFile != -1) {
+    int fd = creat(job->text + job->comms[index].errFile, 0644);
     if (fd != -1) {
       dup2(fd, STDERR_FILENO);
       close(fd);
@@ -279,74 +335,58 @@ void redirect(int index) {
   }
 }
 
+/*Only called in the child right before exec, so the argv array never has to
+be freed*/
+char** buildArgv(int index) {
+  Jobs* job = getJob(currentJob);
+  Commands* com = &job->comms[index];
+  char** argv = malloc((com->numArgs + 1) * sizeof(char*));
+  for (int i = 0; i < com->numArgs; i++)
+    argv[i] = job->text + job->offsets[com->argStart + i];
+  argv[com->numArgs] = NULL;
+  return argv;
+}
+
+void execArgv(int index) {
+  char** argv = buildArgv(index);
+  if (argv[0] == NULL || execvp(argv[0], argv) == -1)
+    exit(9);
+}
+
 void executeCommand() {
+  Jobs* job = getJob(currentJob);
   int pgid = fork();
   if (pgid == 0) {
     setpgid(0, 0);
     redirect(0);
-    if (execvp(jobs[currentJob].comms[0].command,
-               jobs[currentJob].comms[0].arguments) == -1)
-      exit(9);
+    execArgv(0);
   } else {
+    setpgid(pgid, pgid);
     currPgid = pgid;
-    jobs[currentJob].pgid = pgid;
-    int status;
-    if (!jobs[currentJob].bg) {
-      waitpid(pgid, &status, WUNTRACED);
-      if (WIFEXITED(status))
-        jobs[currentJob].finished = true;
-      else if (WIFSTOPPED(status)) {
-        if (WSTOPSIG(status) == SIGTSTP)
-          jobs[currentJob].stop = true;
-        else if (WSTOPSIG(status) == SIGINT)
-          jobs[currentJob].interr = true;
-      }
-    } else {
-      waitpid(pgid, &status, WNOHANG);
-    }
+    job->pgid = pgid;
+    job->liveProcs = 1;
+    if (!job->bg)
+      waitJob(job, true);
   }
 }
 
 void execute2Commands() {
+  Jobs* job = getJob(currentJob);
   int pipefd[2];
-  int status, pid_1, pid_2;
+  int pid_1, pid_2;
   pipe(pipefd);
   pid_1 = fork();
-  if (pid_1 != 0) {
-    currPgid = pid_1;
-    jobs[currentJob].pgid = pid_1;
-
-    int count = 0;
-    while (count < 2) {
-      if (!jobs[currentJob].bg)
-        waitpid(-1 * pid_1, &status, WUNTRACED);
-      else
-        waitpid(-1 * pid_1, &status, WNOHANG);
-
-      if (status == 9)
-        count++;
-      if (WIFEXITED(status)) {
-        jobs[currentJob].finished = true;
-        count++;
-      } else if (WIFSTOPPED(status)) {
-        if (WSTOPSIG(status) == SIGTSTP)
-          jobs[currentJob].stop = true;
-        else if (WSTOPSIG(status) == SIGINT)
-          jobs[currentJob].interr = true;
-      }
-    }
-  } else {
+  if (pid_1 == 0) {
     setpgid(0, 0);
     close(pipefd[0]);               /* Close unused read end */
     dup2(pipefd[1], STDOUT_FILENO); /* Make output go to pipe */
     redirect(0);
-
-    printf(jobs[currentJob].comms[0].arguments);
-    if (execvp(jobs[currentJob].comms[0].command,
-               jobs[currentJob].comms[0].arguments) == -1) {
-      exit(9);
-    }
+    execArgv(0);
   }
+  // set the group from both sides so the right side can always join it
+  setpgid(pid_1, pid_1);
+  currPgid = pid_1;
+  job->pgid = pid_1;
 
   pid_2 = fork();
   if (pid_2 == 0) {
@@ -354,102 +394,92 @@ void execute2Commands() {
     close(pipefd[1]);              /* Close unused write end */
     dup2(pipefd[0], STDIN_FILENO); /* Get input from pipe */
     redirect(1);
-
-    if (execvp(jobs[currentJob].comms[1].command,
-               jobs[currentJob].comms[1].arguments) == -1)
-      exit(9);
+    execArgv(1);
   }
+  setpgid(pid_2, pid_1);
 
   close(pipefd[0]);
   close(pipefd[1]);
 
-  waitpid(-1, &status, 0);
-  waitpid(-1, &status, 0);
+  // background pipelines are picked up by accessJobs like single commands
+  job->liveProcs = 2;
+  if (!job->bg)
+    waitJob(job, true);
 }
 
 void tokenize(char* input) {
-  char *cl_copy, *to_free, *token, *save_ptr;
-  cl_copy = to_free = strdup(input);
+  // Step 1: count tokens so the offset table is sized exactly
+  size_t len = strlen(input);
+  int numTokens = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (input[i] != ' ' && (i == 0 || input[i - 1] == ' '))
+      numTokens++;
+  }
 
-  /*Array that holds a maximum of up to two comms. This corresponds
-  to one job*/
-  Jobs job = {NULL};
-  int cmdIndex = 0;
+  // Step 2: one allocation holds everything the job needs
+  size_t offsetBytes = (numTokens + 2) * sizeof(int);
+  char* block = malloc(offsetBytes + (len + 3) + (len + 1));
 
-  job.comms[0].isCommand = true;
-  job.comms[1].isCommand = true;
-  jobs[nextJob].numCom = 1;
+  JobHandle handle = allocJob();
+  Jobs* job = getJob(handle);
+  job->block = block;
+  job->offsets = (int*)block;
+  job->str = block + offsetBytes;
+  job->text = job->str + len + 3;
+  memcpy(job->str, input, len + 1);
+  memcpy(job->text, input, len + 1);
 
-  // Step 1: Gather data about the input
+  job->numCom = 1;
+  int cmdIndex = 0;
+  int numOffsets = 0;
+  for (int i = 0; i < 2; i++) {
+    job->comms[i].argStart = 0;
+    job->comms[i].numArgs = 0;
+    job->comms[i].inputFile = -1;
+    job->comms[i].outFile = -1;
+    job->comms[i].errFile = -1;
+  }
+  int* pendingFile = NULL;  // set after <, > or 2>: next token is a file
+
+  // Step 3: split the text in place and record offsets
+  char *token, *save_ptr;
+  char* cl_copy = job->text;
   while ((token = strtok_r(cl_copy, " ", &save_ptr))) {
-    if (job.comms[cmdIndex].isCommand) {
-      job.comms[cmdIndex].command = strdup(token);
-      job.comms[cmdIndex].arguments[job.comms[cmdIndex].numArgs] =
-          strdup(token);
-      job.comms[cmdIndex].numArgs++;
-      job.comms[cmdIndex].isCommand = false;
+    cl_copy = NULL;
+    int offset = token - job->text;
+    Commands* com = &job->comms[cmdIndex];
+    if (pendingFile) {
+      *pendingFile = offset;
+      pendingFile = NULL;
     } else if (strcmp(token, "<") == 0) {
-      job.comms[cmdIndex].hasInput = true;
-      job.comms[cmdIndex].inputIndex = job.comms[cmdIndex].numTokens + 1;
+      pendingFile = &com->inputFile;
     } else if (strcmp(token, ">") == 0) {
-      job.comms[cmdIndex].hasOut = true;
-      job.comms[cmdIndex].outIndex = job.comms[cmdIndex].numTokens + 1;
+      pendingFile = &com->outFile;
     } else if (strcmp(token, "2>") == 0) {
-      job.comms[cmdIndex].hasErr = true;
-      job.comms[cmdIndex].errIndex = job.comms[cmdIndex].numTokens + 1;
-    } else if (strcmp(token, "|") == 0) {
-      job.hasPipe = true;
-      job.numCom++;
+      pendingFile = &com->errFile;
+    } else if (strcmp(token, "|") == 0 && cmdIndex == 0) {
+      job->offsets[numOffsets++] = -1;  // terminate the left argv
+      job->hasPipe = true;
+      job->numCom++;
       cmdIndex++;
-    } else if (strcmp(token, "&") == 0)
-      job.bg = true;
-    else if (job.comms[cmdIndex].numTokens != job.comms[cmdIndex].inputIndex &&
-             job.comms[cmdIndex].numTokens != job.comms[cmdIndex].outIndex &&
-             job.comms[cmdIndex].numTokens != job.comms[cmdIndex].errIndex) {
-      job.comms[cmdIndex].arguments[job.comms[cmdIndex].numArgs] =
-          strdup(token);
-      job.comms[cmdIndex].numArgs++;
-    }
-    if (strcmp(token, "|") != 0) {
-      job.comms[cmdIndex].tokenCommand[job.comms[cmdIndex].numTokens] =
-          strdup(token);
-      job.comms[cmdIndex].numTokens++;
+      job->comms[cmdIndex].argStart = numOffsets;
+    } else if (strcmp(token, "&") == 0) {
+      job->bg = true;
+    } else {
+      job->offsets[numOffsets++] = offset;
+      com->numArgs++;
     }
-
-    cl_copy = NULL;
-  }
-
-  for (int i = 0; i < cmdIndex + 1; i++) {
-    if (job.comms[i].hasInput)
-      job.comms[i].inputFile =
-          strdup(job.comms->tokenCommand[job.comms[cmdIndex].inputIndex]);
-    if (job.comms[i].hasOut)
-      job.comms[i].outFile =
-          strdup(job.comms->tokenCommand[job.comms[cmdIndex].outIndex]);
-    if (job.comms[i].hasErr)
-      job.comms[i].errFile =
-          strdup(job.comms->tokenCommand[job.comms[cmdIndex].errIndex]);
   }
+  job->offsets[numOffsets] = -1;
 
-  jobs[nextJob] = job;
+  if (liveCount == 1)
+    setPlusJob(handle);
+  job->jobNumber = ++jobNumber;
 
-  if (nextJob == 0)
-    jobs[nextJob].fg = true;
-  jobs[nextJob].jobNumber = ++jobNumber;
-  jobs[nextJob].str = strdup(input);
-  free(to_free);
-
-  currentJob = nextJob;
-  nextJob++;
-}
-
-void jobSetup() {
-  for (int i = 0; i < 20; i++)
-    jobs[i].pgid = 1;
+  currentJob = handle;
 }
 
 int main() {
-  jobSetup();
   char* input;
 
   input = readline("# ");
@@ -469,7 +499,7 @@ int main() {
         printJobs();
       } else {
         tokenize(input);
-        if (!jobs[currentJob].hasPipe)
+        if (!getJob(currentJob)->hasPipe)
           executeCommand();
         else
           execute2Commands();
@@ -478,4 +508,4 @@ int main() {
     }
     input = readline("# ");
   }
-}
\ No newline at end of file
+}
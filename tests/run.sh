@@ -0,0 +1,57 @@
+#!/bin/sh
+# Regression tests: each one runs 'yash -c' strings and compares what they
+# print with what is expected.
+#
+#   sh tests/run.sh [yash binary]
+yash=${1:-./yash}
+tmp=$(mktemp -d /tmp/yash-test.XXXXXX)
+trap 'rm -rf "$tmp"' EXIT
+fails=0
+
+# run STRING: yash -c STRING, stdout and stderr
+run() {
+  "$yash" -c "$1" 2>&1
+}
+
+# expect NAME EXPECTED ACTUAL
+expect() {
+  if [ "$2" != "$3" ]; then
+    printf 'FAIL %s\n  expected: %s\n  got:      %s\n' "$1" "$2" "$3"
+    fails=$((fails + 1))
+  fi
+}
+
+expect "fan-out to many consumers" 12 \
+  "$(run 'echo hi |> { cat, cat, cat, cat, cat, cat, cat, cat, cat, cat, cat, cat }' |
+    grep -c '^hi$')"
+
+head -c 67108864 /dev/zero > "$tmp/big"
+out=$(run "/bin/true | cat $tmp/big &
+wait > $tmp/wait.out" | wc -c)
+expect "background builtin stage keeps its stdout" 67108864 "$out"
+expect "background builtin stage misses a later redirection" 0 \
+  "$(stat -c %s "$tmp/wait.out")"
+
+run "cat $tmp/big | wc -c > $tmp/count & /bin/sleep 1"
+expect "-c tail call waits for background builtin stages" 67108864 \
+  "$(cat "$tmp/count")"
+
+expect "pipesize past a long is rejected" \
+  "set: 9007199254740992m: invalid pipe size" \
+  "$(run 'set -o pipesize=9007199254740992m')"
+expect "parchunk past a long is rejected" \
+  "set: 9223372036854775807k: invalid chunk size" \
+  "$(run 'set -o parchunk=9223372036854775807k')"
+
+expect "\$? inside words and double quotes" "status=1 [1] \$? \$? 1x" \
+  "$(run 'false
+echo status=$? "[$?]" '"'\$?'"' \$? ${?}x')"
+expect "\$PIPESTATUS inside words and double quotes" "0 1 3 p=0 1 3," \
+  "$(run '/bin/true | false | /bin/sh -c "exit 3"
+echo "${PIPESTATUS}" p=$PIPESTATUS,')"
+
+if [ $fails -ne 0 ]; then
+  echo "tests: $fails failed"
+  exit 1
+fi
+echo "tests: all passed"
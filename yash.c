@@ -1,72 +1,333 @@
+#define _GNU_SOURCE  // pipe2, F_SETPIPE_SZ, memfd_create
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <readline/history.h>
 #include <readline/readline.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef LEAK_CHECK
+#include <sanitizer/lsan_interface.h>
+#endif
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+// glibc 2.35 can hand the terminal to a spawned child before it execs
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+#define HAVE_SPAWN_TCSETPGRP 1
+#endif
+
+extern char** environ;
 
-#define MAX_ARGS 127
 #define TRUE 1
 #define FALSE 0
 #define RUNNING 0
 #define STOPPED 1
 #define DONE 2
 
+// one process (pipeline stage) of a job
+typedef struct JobMember {
+  pid_t pid;   // 0 for a builtin running on a thread
+  int state;   // RUNNING/STOPPED/DONE
+  int status;  // exit code, 128+signal if killed or stopped by one
+} JobMember;
+
+// pipelines up to this long keep their members inside the Job record
+#define JOB_INLINE_MEMBERS 2
+
 // Job object
 typedef struct Job {
   struct Job* prevJob;
   int jobNum;
   int status;       // 0=running, 1=stopped, 2=done/completed
-  char* jobString;  // original command
-  pid_t pgid;       // group id
-  pid_t leftChildID;
-  pid_t rightChildID;
+  char* jobString;  // original command, owned by the job
+  pid_t pgid;       // group id, pid of the first stage
   int isBackground;  // boolean. 1=yes, 2=no
+  int numMembers;      // pipeline stages
+  JobMember* members;  // inlineMembers, or malloc'd for long pipelines
+  JobMember inlineMembers[JOB_INLINE_MEMBERS];
+  int dirty;           // status changed since the last prompt
+  struct Job* prevDirty;
+  struct Job* nextDirty;
   struct Job* nextJob;
 } Job;
 
+// token kinds produced by the lexer
+#define TOK_WORD 0
+#define TOK_PIPE 1      // |
+#define TOK_AMP 2       // &
+#define TOK_LESS 3      // <
+#define TOK_GREAT 4     // >
+#define TOK_ERRGREAT 5  // 2>
+#define TOK_SEMI 6      // ;
+#define TOK_AND_IF 7    // &&
+#define TOK_OR_IF 8     // ||
+#define TOK_LPAREN 9    // (
+#define TOK_RPAREN 10   // )
+#define TOK_FANOUT 11   // |>
+
+// a token is a span of the input line, nothing is copied while lexing
+typedef struct Token {
+  int type;
+  int start;   // offset of the first byte in the line
+  int len;
+  int quoted;  // word contains quotes or backslashes to strip
+} Token;
+
+// one simple command of a line: its argv and redirections
+typedef struct Command {
+  char** argv;  // NULL terminated
+  int argc;
+  char* inFile;   // target of <, NULL if none
+  char* outFile;  // target of >
+  char* errFile;  // target of 2>
+  int expand;     // argv holds templates for $? or $PIPESTATUS (PARAM_MARK)
+  int replicas;   // '@N' prefix: N copies over chunks of stdin, -1: a copy
+                  // per CPU, 0: none
+} Command;
+
+// AST node kinds
+#define NODE_CMD 0       // simple command
+#define NODE_PIPE 1      // pipeline, the children are its stages
+#define NODE_AND 2       // a && b
+#define NODE_OR 3        // a || b
+#define NODE_LIST 4      // a; b; c
+#define NODE_BG 5        // a &
+#define NODE_SUBSHELL 6  // ( list )
+#define NODE_GROUP 7     // { list; }
+#define NODE_FANOUT 8    // |> { a, b }: the children are the consumer pipelines
+
+// node of the parsed line. Nodes live in one flat array and refer to each
+// other by index
+typedef struct Node {
+  int type;
+  int child;    // first child, -1 if none
+  int next;     // next sibling, -1 if last
+  int start;    // source text of the node (the job string of a pipeline)
+  int len;
+  Command cmd;  // argv of NODE_CMD, redirections of CMD/SUBSHELL/GROUP
+  int hasLimit;  // NODE_PIPE started with a 'timeout' prefix
+  struct timespec limit;
+  struct timespec grace;
+} Node;
+
+// a parsed command line
+typedef struct Ast {
+  const char* line;  // source text the node spans point into
+  Node* nodes;
+  int numNodes;
+  int root;  // index of the top NODE_LIST
+} Ast;
+
+// one slot of the pid -> Job index (open addressing, linear probing)
+typedef struct PidSlot {
+  pid_t pid;  // 0 = empty slot
+  Job* job;
+  int stage;  // index into job->members
+} PidSlot;
+
+PidSlot* pidIndex = NULL;  // hash table keyed by member pid (pgid included)
+int pidIndexCap = 0;       // always a power of 2
+int pidIndexUsed = 0;
+
+Job** jobTable = NULL;  // jobTable[jobNum] -> Job on the stack, or NULL
+int jobTableCap = 0;
+
+/**
+ * @brief home slot of a pid in the pid index
+ *
+ * @param pid the pid to hash
+ * @return int slot index (caller keeps probing linearly from there)
+ */
+int pidHash(pid_t pid) {
+  unsigned int h = (unsigned int)pid * 2654435761u;  // Knuth multiplicative
+  return (int)(h & (unsigned int)(pidIndexCap - 1));
+}
+
+/**
+ * @brief add (or overwrite) the pid -> job mapping, growing the table at 50%
+ *
+ * @param pid member process id
+ * @param job the job it belongs to
+ * @param stage which member of the job the pid is
+ */
+void indexPid(pid_t pid, Job* job, int stage) {
+  if ((pidIndexUsed + 1) * 2 > pidIndexCap) {
+    // rehash everything into a table twice the size
+    PidSlot* old = pidIndex;
+    int oldCap = pidIndexCap;
+    pidIndexCap = oldCap ? oldCap * 2 : 64;
+    pidIndex = calloc(pidIndexCap, sizeof(PidSlot));
+    pidIndexUsed = 0;
+    for (int i = 0; i < oldCap; i++) {
+      if (old[i].pid)
+        indexPid(old[i].pid, old[i].job, old[i].stage);
+    }
+    free(old);
+  }
+  int i = pidHash(pid);
+  while (pidIndex[i].pid && pidIndex[i].pid != pid)
+    i = (i + 1) & (pidIndexCap - 1);
+  if (!pidIndex[i].pid)
+    pidIndexUsed++;
+  pidIndex[i].pid = pid;
+  pidIndex[i].job = job;
+  pidIndex[i].stage = stage;
+}
+
+/**
+ * @brief look up which job (and which member of it) a pid belongs to
+ *
+ * @param pid member process id
+ * @param stage out param, set to the member index when found (may be NULL)
+ * @return Job* owner of pid, NULL if the pid is unknown
+ */
+Job* findJobByPid(pid_t pid, int* stage) {
+  if (!pidIndexCap || pid <= 0)
+    return NULL;
+  for (int i = pidHash(pid); pidIndex[i].pid; i = (i + 1) & (pidIndexCap - 1)) {
+    if (pidIndex[i].pid == pid) {
+      if (stage)
+        *stage = pidIndex[i].stage;
+      return pidIndex[i].job;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief drop a pid from the index. Uses backward-shift deletion so lookups
+ * never need tombstones.
+ *
+ * @param pid member process id to forget
+ * @param job only remove the mapping if it still points at this job
+ */
+void unindexPid(pid_t pid, Job* job) {
+  if (!pidIndexCap || pid <= 0)
+    return;
+  int mask = pidIndexCap - 1;
+  int i = pidHash(pid);
+  while (pidIndex[i].pid && pidIndex[i].pid != pid)
+    i = (i + 1) & mask;
+  if (!pidIndex[i].pid || pidIndex[i].job != job)
+    return;  // not there, or the pid was reused by a newer job
+  pidIndexUsed--;
+  // pull later entries of the same probe run back into the hole
+  for (int j = (i + 1) & mask; pidIndex[j].pid; j = (j + 1) & mask) {
+    int home = pidHash(pidIndex[j].pid);
+    // move j into i unless its home lies cyclically in (i, j]
+    if ((j > i && (home <= i || home > j)) ||
+        (j < i && (home <= i && home > j))) {
+      pidIndex[i] = pidIndex[j];
+      i = j;
+    }
+  }
+  pidIndex[i].pid = 0;
+  pidIndex[i].job = NULL;
+}
+
+// Job records are recycled instead of going back to malloc every command
+#define JOB_POOL_BLOCK 64
+
+Job* jobPool = NULL;  // free Job records, chained through nextJob
+
+/**
+ * @brief take a Job record from the pool, refilling it a block at a time
+ *
+ * @return Job* uninitialized record
+ */
+Job* allocJobRecord() {
+  if (!jobPool) {
+    Job* block = malloc(JOB_POOL_BLOCK * sizeof(Job));
+    for (int i = 0; i < JOB_POOL_BLOCK; i++) {
+      block[i].nextJob = jobPool;
+      jobPool = &block[i];
+    }
+  }
+  Job* job = jobPool;
+  jobPool = job->nextJob;
+  return job;
+}
+
+/**
+ * @brief return a Job record to the pool
+ *
+ * @param job record no longer referenced anywhere
+ */
+void freeJobRecord(Job* job) {
+  job->nextJob = jobPool;
+  jobPool = job;
+}
+
 /**
  * @brief creates a new Job "object" like OOP language would. Callers need to
  * handle stack and jobNum
  *
- * @param pid1 first command
- * @param pid2 (if any) second command. (if none) put -1
+ * @param pids pid of every pipeline stage, -1 for a stage that could not be
+ * started (it counts as done). The first started stage leads the group
+ * @param numPids number of stages
  * @param isBackground boolean. 1=start from background, 0=otherwise
- * @param jobString the original command string input
- * @return Job* pointer to a malloc'd Job object
+ * @param jobString the command text of the job (need not be NUL terminated).
+ * The job keeps its own copy
+ * @param jobStringLen length of jobString
+ * @return Job* pointer to a pooled Job object
  */
-Job* newJob(int pid1, int pid2, int isBackground, char* jobString) {
-  Job* job = malloc(sizeof(Job));
+Job* newJob(pid_t pids[],
+            int numPids,
+            int isBackground,
+            const char* jobString,
+            int jobStringLen) {
+  Job* job = allocJobRecord();
 
-  if (setpgid(pid1, 0) == -1) {
-    // perror("FAILED TO CREATE NEW GROUP FOR THIS JOB\n");
-  } else {
-    // fprintf(stderr, "SUCCESSFULLY CREATE NEW JOB GROUP\n");
-  }
-  if (pid2 != -1)
-    setpgid(pid2, pid1);
   // fill up known inputs
-  job->pgid = pid1;
-  job->leftChildID = pid1;
-  job->rightChildID = pid2;
-  job->isBackground = isBackground;
-  job->jobString = jobString;
-  if (jobString && isBackground) {
-    // null the space before '&' in jobString (assumed end with " &")
-    int cmd_len = strlen(jobString);
-    jobString[cmd_len - 2] = 0x00;
+  job->pgid = -1;
+  for (int i = numPids - 1; i >= 0; i--) {
+    if (pids[i] > 0)
+      job->pgid = pids[i];
   }
+  job->isBackground = isBackground;
+  job->jobString = strndup(jobString, jobStringLen);
 
   // job defaulted to running upon creation
   job->status = RUNNING;
+  job->numMembers = numPids;
+  job->members = job->inlineMembers;
+  if (numPids > JOB_INLINE_MEMBERS)
+    job->members = malloc(numPids * sizeof(JobMember));
+  for (int i = 0; i < numPids; i++) {
+    job->members[i].pid = pids[i];
+    job->members[i].state = (pids[i] > 0 ? RUNNING : DONE);
+    job->members[i].status = 0;
+    if (pids[i] > 0)
+      indexPid(pids[i], job, i);
+  }
+  job->dirty = FALSE;
+  job->prevDirty = NULL;
+  job->nextDirty = NULL;
 
   // no association with stack for now. caller handles stack interaction
   job->jobNum = -1;
@@ -82,39 +343,75 @@ Job* newJob(int pid1, int pid2, int isBackground, char* jobString) {
  * @param job the job obj to be freed
  */
 void delJob(Job* job) {
+  for (int i = 0; i < job->numMembers; i++)
+    unindexPid(job->members[i].pid, job);
+  if (job->members != job->inlineMembers)
+    free(job->members);
   free(job->jobString);
-  free(job);
+  freeJobRecord(job);
 }
 
 Job* stack_base = NULL;  // top of Jobs stack
 Job* stack_top = NULL;   // base of Jobs stack
 
+// the current ('+') job: most recent running or stopped job on the stack.
+// maintained on every stack/status change so nobody has to search for it
+Job* plusJob = NULL;
+int numDoneJobs = 0;  // DONE jobs still on the stack waiting to be reported
+
+// stack jobs whose status changed since the last prompt (doubly-linked)
+Job* dirtyJobs = NULL;
+
 // the yash process, the mother of all processes
 pid_t yash = -1;
 
 // whichever job holds terminal control
 Job* foreground = NULL;
+
+// exit status of the last foreground job ($?) and of each of its stages
+int lastStatus = 0;
+int* pipeStatus = NULL;
+int pipeStatusCap = 0;
+int pipeStatusLen = 0;
+
+// a word that refers to $? or $PIPESTATUS is kept as a template, filled in
+// when the command runs: PARAM_MARK, then the word with every reference
+// written as PARAM_MARK and its kind, and its own PARAM_MARK bytes doubled
+#define PARAM_MARK '\001'
+#define PARAM_STATUS '?'
+#define PARAM_PIPESTATUS 'P'
+
+// FALSE in forked subshells: their pipelines stay in the subshell's process
+// group and never touch the terminal
+int jobControl = TRUE;
+
+// a foreground job was killed by ^C, the rest of the line is skipped
+int lineInterrupted = FALSE;
+
+// 'yash -c': the pipeline of the line being run that may exec in place of
+// yash, -1 if none
+int tailPipe = -1;
+int execTailCall = FALSE;  // the line being run is the last of 'yash -c'
+
 /**
- * @brief yash leaves target's job group and forfeits terminal rights
+ * @brief target's job group forfeits terminal rights, yash takes them back
  *
- * @param target the Job to loose yash (give up terminal)
+ * @param target the Job leaving the foreground
  */
 void giveUpTerminalRights(Job* target) {
-  if (-1 == setpgid(yash, 0)) {
-    // fprintf(stderr, "failed to spin off a new yash group\n");
-  } else {
-    // fprintf(stderr, "yash left the group\n");
-  }
-  tcsetpgrp(0, getpgid(yash));
+  if (jobControl)
+    tcsetpgrp(0, getpgid(yash));
 }
 /**
- * @brief yash joins target job group to give access to terminal
+ * @brief give target's job group access to the terminal. yash stays in its
+ * own group: a job group whose only outside parent is yash must not be
+ * orphaned, or the terminal's ^Z never stops it
  *
- * @param target the Job to join yash's group (access terminal)
+ * @param target the Job to access terminal
  */
 void accessTerminalRights(Job* target) {
-  setpgid(yash, target->pgid);
-  tcsetpgrp(0, getpgid(yash));
+  if (jobControl && target->pgid > 0)
+    tcsetpgrp(0, target->pgid);
 }
 
 /**
@@ -128,6 +425,107 @@ int equal(const char* s1, const char* s2) {
   return (strcmp(s1, s2) == 0);
 }
 
+/**
+ * @brief make jobTable big enough to hold jobNum
+ *
+ * @param jobNum job number about to be used
+ */
+void reserveJobNum(int jobNum) {
+  if (jobNum < jobTableCap)
+    return;
+  int newCap = jobTableCap ? jobTableCap : 16;
+  while (newCap <= jobNum)
+    newCap *= 2;
+  jobTable = realloc(jobTable, newCap * sizeof(Job*));
+  memset(jobTable + jobTableCap, 0, (newCap - jobTableCap) * sizeof(Job*));
+  jobTableCap = newCap;
+}
+
+/**
+ * @brief look up a job on the stack by its job number
+ *
+ * @param jobNum the number shown in brackets by 'jobs'
+ * @return Job* the job, NULL if no such job
+ */
+Job* findJobByNum(int jobNum) {
+  if (jobNum <= 0 || jobNum >= jobTableCap)
+    return NULL;
+  return jobTable[jobNum];
+}
+
+/**
+ * @brief the next '+' candidate at or below the given job on the stack
+ *
+ * @param from where to start looking (towards the base)
+ * @return Job* most recent running or stopped job, NULL if none
+ */
+Job* findPlusCandidate(Job* from) {
+  for (Job* curr = from; curr; curr = curr->prevJob) {
+    if (curr->status == RUNNING || curr->status == STOPPED) {
+      return curr;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief put a job on the dirty list so the next prompt looks at it
+ *
+ * @param job the job whose status changed
+ */
+void markJobDirty(Job* job) {
+  if (job->dirty)
+    return;
+  job->dirty = TRUE;
+  job->prevDirty = NULL;
+  job->nextDirty = dirtyJobs;
+  if (dirtyJobs)
+    dirtyJobs->prevDirty = job;
+  dirtyJobs = job;
+}
+
+/**
+ * @brief take a job off the dirty list
+ *
+ * @param job the job that has been dealt with
+ */
+void clearJobDirty(Job* job) {
+  if (!job->dirty)
+    return;
+  if (job->prevDirty)
+    job->prevDirty->nextDirty = job->nextDirty;
+  else
+    dirtyJobs = job->nextDirty;
+  if (job->nextDirty)
+    job->nextDirty->prevDirty = job->prevDirty;
+  job->dirty = FALSE;
+  job->prevDirty = NULL;
+  job->nextDirty = NULL;
+}
+
+/**
+ * @brief change a job's status, keeping plusJob and the done count in sync
+ *
+ * @param job the job to update
+ * @param status RUNNING, STOPPED or DONE
+ */
+void setJobStatus(Job* job, int status) {
+  if (job->status == status)
+    return;
+  int onStack = job->jobNum > 0;
+  if (onStack && job->status == DONE)
+    numDoneJobs--;
+  job->status = status;
+  if (!onStack)
+    return;
+  markJobDirty(job);
+  if (status == DONE) {
+    numDoneJobs++;
+    if (job == plusJob)
+      plusJob = findPlusCandidate(job->prevJob);
+  }
+}
+
 /**
  * @brief append job to the top of doubly-linked job stack
  *
@@ -149,6 +547,12 @@ void appendJobToStack(Job* job) {
 
     job->jobNum = 1 + prevJob->jobNum;
   }
+  reserveJobNum(job->jobNum);
+  jobTable[job->jobNum] = job;
+  if (job->status == DONE)
+    numDoneJobs++;
+  else
+    plusJob = job;  // newest live job is always the '+' job
 }
 /**
  * @brief cut ties of input job from the stack and heals the stack
@@ -159,6 +563,13 @@ void removeJobFromStack(Job* currJob) {
   Job* prev = currJob->prevJob;
   Job* next = currJob->nextJob;
 
+  if (currJob == plusJob)
+    plusJob = findPlusCandidate(prev);
+  if (currJob->status == DONE)
+    numDoneJobs--;
+  jobTable[currJob->jobNum] = NULL;
+  clearJobDirty(currJob);
+
   if (next) {
     // when there are more behind this job, pass currJob's prev back
     next->prevJob = currJob->prevJob;
@@ -174,6 +585,11 @@ void removeJobFromStack(Job* currJob) {
     // currJob is on the base of stack. set stack_base to next (NULL or JOB*)
     stack_base = next;
   }
+
+  // job is free floating now (fg job or about to be deleted)
+  currJob->prevJob = NULL;
+  currJob->nextJob = NULL;
+  currJob->jobNum = -1;
 }
 /**
  * @brief based on bg job stack, return the most recent running or stopped job
@@ -181,506 +597,4719 @@ void removeJobFromStack(Job* currJob) {
  * @return Job* pointer to Job that can be brought to foreground via 'fg'
  */
 Job* getNextJobInLine() {
-  for (Job* curr = stack_top; curr; curr = curr->prevJob) {
-    if (curr->status == RUNNING || curr->status == STOPPED) {
-      return curr;
+  return plusJob;
+}
+
+/**
+ * @brief resolve a job spec as given to fg/bg ("%N", "N", "%+", "%%")
+ *
+ * @param spec the argument after fg/bg, NULL for the default job
+ * @return Job* the matching job on the stack, NULL if none
+ */
+Job* resolveJobSpec(const char* spec) {
+  if (!spec)
+    return NULL;
+  if (spec[0] == '%')
+    spec++;
+  if (equal(spec, "+") || equal(spec, "%") || equal(spec, ""))
+    return plusJob;
+  char* end;
+  long jobNum = strtol(spec, &end, 10);
+  if (*end != 0 || jobNum <= 0 || jobNum > __INT_MAX__)
+    return NULL;
+  return findJobByNum((int)jobNum);
+}
+
+/**
+ * @brief growable output buffer so a batch of lines goes out in one write
+ */
+typedef struct OutBuf {
+  char* data;
+  size_t len;
+  size_t cap;
+} OutBuf;
+
+/**
+ * @brief printf onto the end of an OutBuf
+ *
+ * @param buf the buffer to append to
+ * @param fmt printf format
+ */
+void bufPrintf(OutBuf* buf, const char* fmt, ...) {
+  va_list ap;
+  while (TRUE) {
+    size_t room = buf->cap - buf->len;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf->data ? buf->data + buf->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if (n < 0)
+      return;
+    if ((size_t)n < room) {
+      buf->len += n;
+      return;
     }
+    size_t newCap = buf->cap ? buf->cap : 256;
+    while (newCap - buf->len <= (size_t)n)
+      newCap *= 2;
+    buf->data = realloc(buf->data, newCap);
+    buf->cap = newCap;
   }
-  return NULL;
+}
+
+/**
+ * @brief write the buffer to fd with a single write and reset it
+ *
+ * @param buf the buffer to flush
+ * @param fd where it goes
+ */
+void bufFlush(OutBuf* buf, int fd) {
+  fflush(stdout);  // keep ordering with anything printf'd before
+  size_t off = 0;
+  while (off < buf->len) {
+    ssize_t n = write(fd, buf->data + off, buf->len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    off += n;
+  }
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
 }
 
 /**
  * @brief print a single Job's summary
  *
+ * @param buf where the line goes
  * @param curr Job*, the job to be printed
  * @param fgCandidate Job*, if equal to curr then print '+', else print '-'
  */
-void printJob(Job* curr, Job* fgCandidate) {
+void printJob(OutBuf* buf, Job* curr, Job* fgCandidate) {
   char* status = (curr->status == RUNNING
                       ? "Running"
                       : (curr->status == STOPPED ? "Stopped" : "Done"));
-  printf("[%d] %c %s\t%s%s\n", curr->jobNum, (curr == fgCandidate ? '+' : '-'),
-         status, curr->jobString, (curr->status != STOPPED ? " &" : ""));
+  bufPrintf(buf, "[%d] %c %s\t%s%s\n", curr->jobNum,
+            (curr == fgCandidate ? '+' : '-'), status, curr->jobString,
+            (curr->status != STOPPED ? " &" : ""));
 }
 
 /**
  * @brief prints job for bg format (eg. "[1] + sleep 4 &")
  *
+ * @param fd where the line goes
  * @param target
  */
-void printJobNoStatus(Job* target) {
-  printf("[%d] %c %s\t%s\n", target->jobNum,
-         (target == getNextJobInLine() ? '+' : '-'), target->jobString,
-         (target->status == RUNNING ? " &" : ""));
+void printJobNoStatus(int fd, Job* target) {
+  dprintf(fd, "[%d] %c %s\t%s\n", target->jobNum,
+          (target == plusJob ? '+' : '-'), target->jobString,
+          (target->status == RUNNING ? " &" : ""));
 }
 
 /**
  * @brief prints all done jobs, followed by the rest of the stack
+ *
+ * @param fd where the list goes
  */
-void printJobs() {
-  Job* fgCandidate = getNextJobInLine();
-  for (Job* curr = stack_base; curr; curr = curr->nextJob) {
-    if (curr->status == DONE)
-      printJob(curr, fgCandidate);
+void printJobs(int fd) {
+  OutBuf buf = {0};
+  if (numDoneJobs > 0) {
+    for (Job* curr = stack_base; curr; curr = curr->nextJob) {
+      if (curr->status == DONE)
+        printJob(&buf, curr, plusJob);
+    }
   }
   for (Job* curr = stack_base; curr; curr = curr->nextJob) {
     if (curr->status != DONE)
-      printJob(curr, fgCandidate);
+      printJob(&buf, curr, plusJob);
   }
+  bufFlush(&buf, fd);
 }
 
 /**
- * @brief print all and only the done jobs on stack
+ * @brief recompute a job's status from the state of its member processes.
+ * Done only once every member exited; stopped as soon as any member stopped.
  *
+ * @param job the job to refresh
  */
-void printJobsDone() {
-  Job* plusJob = getNextJobInLine();
-  for (Job* curr = stack_base; curr; curr = curr->nextJob) {
-    if (curr->status == DONE)
-      printJob(curr, plusJob);
-  }
-}
-
-void updateJobStatus() {
-  Job* currJob = stack_base;
-  while (currJob) {
-    // update job status
-    int status;  // used for probing process status
-    int ret = waitpid(-1 * currJob->pgid, &status, WNOHANG | WUNTRACED);
-    if (ret != 0 && ret != -1) {
-      // printf("\tChecking exit status... ");
-      if (WIFEXITED(status)) {  // if job exited normally
-        currJob->status = DONE;
-        // printf("DONE! %s\n", currJob->jobString);
-      } else if (WIFSTOPPED(status)) {  // if job stopped by signal
-        currJob->status = STOPPED;
-        // printf("STOPPED! %s\n", currJob->jobString);
-      } else if (WIFCONTINUED(status)) {  // if job resumed by SIGCONT
-        currJob->status = RUNNING;
-        // printf("RUNNING! %s\n", currJob->jobString);
-      } else {
-        // printf("\tNo change!\n");
-      }
-    }
-
-    currJob = currJob->nextJob;  // increment loop
+void refreshJobStatus(Job* job) {
+  int allDone = TRUE;
+  int anyStopped = FALSE;
+  for (int i = 0; i < job->numMembers; i++) {
+    if (job->members[i].state != DONE)
+      allDone = FALSE;
+    if (job->members[i].state == STOPPED)
+      anyStopped = TRUE;
   }
+  setJobStatus(job, allDone ? DONE : (anyStopped ? STOPPED : RUNNING));
 }
 
 /**
- * @brief remove done jobs from the stack
+ * @brief record a state change of one member process of a job
  *
- * @param skipMessage boolean, true to not display bg done jobs
+ * @param job the job the member belongs to
+ * @param stage which member (pipeline position)
+ * @param state RUNNING, STOPPED or DONE
+ * @param exitStatus exit code (128+signal if killed/stopped by one)
  */
-void updateJobStack(int isJobCommand) {
-  // go thorough all processes on stack, update status of each one, remove done
-  updateJobStatus();  // make sure stack is up-to-date
-  Job* currJob = stack_base;
-  Job* plusJob = getNextJobInLine();
-  if (isJobCommand) {
-    printJobsDone();
-  }
-  while (currJob) {
-    // fprintf(stderr, "\tchecking %s\n", currJob->jobString);
-    //  update stack
-    if (currJob->status == DONE) {
-      if (!isJobCommand) {
-        printJob(currJob, plusJob);
-      }
-      // remove this job from stack and free it
-      // fprintf(stderr, "\t!removing %s\n", currJob->jobString);
-      removeJobFromStack(currJob);
-      Job* dyingJob = currJob;     // mark currJob as dead
-      currJob = currJob->nextJob;  // increment loop
-      delJob(dyingJob);            // kill popped job
-      continue;                    // no need to check dead job
-    }
-    currJob = currJob->nextJob;  // increment loop
+void setMemberState(Job* job, int stage, int state, int exitStatus) {
+  job->members[stage].state = state;
+  if (state != RUNNING)
+    job->members[stage].status = exitStatus;
+  if (state == DONE) {
+    // reaped, the pid may be reused from now on
+    unindexPid(job->members[stage].pid, job);
   }
+  refreshJobStatus(job);
 }
 
 /**
- * @brief resume latest stopped job to continue in background. assumes stopped
- * job is already on the stack
+ * @brief record one waitpid() result against the job that owns the pid
+ *
+ * @param pid the child waitpid reported
+ * @param status the wait status that came with it
  */
-void bg() {
-  Job* curr = stack_top;
-  while (curr) {
-    if (curr->status == STOPPED) {
-      if (kill(-1 * curr->pgid, SIGCONT) < 0) {
-        perror("bg SIGCONT");  // sigcont error occurred
-      } else {
-        // when successfully resumed the stopped job
-        curr->status = RUNNING;
-        printJobNoStatus(curr);
-      }
-      return;
-    }
-    curr = curr->prevJob;
+void recordChildStatus(pid_t pid, int status) {
+  int stage;
+  Job* job = findJobByPid(pid, &stage);
+  if (!job)
+    return;  // not one of ours (or job already deleted)
+  if (WIFEXITED(status)) {
+    setMemberState(job, stage, DONE, WEXITSTATUS(status));
+  } else if (WIFSIGNALED(status)) {
+    setMemberState(job, stage, DONE, 128 + WTERMSIG(status));
+  } else if (WIFSTOPPED(status)) {
+    setMemberState(job, stage, STOPPED, 128 + WSTOPSIG(status));
+  } else if (WIFCONTINUED(status)) {
+    setMemberState(job, stage, RUNNING, 0);
   }
-  perror("bg no target found");
 }
 
+// a builtin running on a worker thread as a pipeline stage. Only fds and
+// status are the thread's; the shell learns it finished when the task's
+// pointer comes out of builtinDonePipe
+typedef struct BuiltinTask {
+  const struct Builtin* builtin;
+  char** argv;     // private copy, the line's arena goes away first
+  int fds[3];      // stdin, stdout, stderr, all above 2 and the task's own
+  int snapshotFd;  // memfd the shell already rendered the output into, or -1
+  int* outs;       // fan-out: fds[0] is copied into each of these instead
+  int numOuts;
+  int status;
+  Job* job;  // set once the job exists
+  int stage;
+  int joined;  // finished before its job existed, the job picks it up
+  pthread_t thread;
+} BuiltinTask;
+
+// builtin threads write their finished BuiltinTask* here
+int builtinDonePipe[2] = {-1, -1};
+
 /**
- * @brief bring latest job on stack to continue/resume in foreground
+ * @brief (re)create builtinDonePipe. A forked subshell needs its own, or it
+ * would be reading its parent's tasks
  */
-void fg() {
-  Job* target = getNextJobInLine();
-  if (!target) {
-    perror("fg no target found");
+void openBuiltinDonePipe() {
+  if (builtinDonePipe[0] >= 0) {
+    close(builtinDonePipe[0]);
+    close(builtinDonePipe[1]);
+  }
+  if (pipe2(builtinDonePipe, O_CLOEXEC) < 0) {
+    builtinDonePipe[0] = -1;
+    builtinDonePipe[1] = -1;  // builtin stages get forked instead
     return;
   }
-  // fprintf(stderr,
-  //         "fg target leader pid = %d\tsignal send to group = %d\treal pgid =
-  //         "
-  //         "%d\tyash pgid = %d\n",
-  //         target->leftChildID, target->pgid, getpgid(target->leftChildID),
-  //         yash);
-  if (kill(-1 * target->pgid, SIGCONT) < 0) {
-    perror("fg SIGCONT");  // sigcont error occurred
-  } else {
-    target->status = RUNNING;
-    removeJobFromStack(target);
+  fcntl(builtinDonePipe[0], F_SETFL, O_NONBLOCK);
+}
 
-    accessTerminalRights(target);
-    foreground = target;
-    printf("%s\n", foreground->jobString);
-    waitpid(target->leftChildID, NULL, WUNTRACED);
-    if (target->rightChildID != -1) {
-      waitpid(target->rightChildID, NULL, WUNTRACED);
+/**
+ * @brief join every builtin thread that finished and mark its stage done
+ */
+void reapBuiltinThreads() {
+  BuiltinTask* task;
+  while (builtinDonePipe[0] >= 0 &&
+         read(builtinDonePipe[0], &task, sizeof(task)) == sizeof(task)) {
+    pthread_join(task->thread, NULL);
+    if (!task->job) {
+      task->joined = TRUE;  // executePipeline is still starting its job
+      continue;
     }
-
-    giveUpTerminalRights(target);
-    foreground = NULL;
-    // delJob(target);
+    setMemberState(task->job, task->stage, DONE, task->status);
+    free(task);
   }
 }
 
 /**
- * @brief open files for the command
+ * @brief how many stages of a job are builtins still running on a thread
  *
- * @param tokens parsed list of commands
- * @param numToks number of command tokens (not including &)
+ * @param job the job to look at
+ * @return int number of such stages
  */
-void redirect(char* tokens[], int numToks) {
-  int fd_in, fd_out, fd_err;
-  // goes through each token to check for [<, >, 2>]
-  for (int i = 0; i < numToks - 1; i++) {
-    char* currToken = tokens[i];
-    char* nextToken = tokens[i + 1];
-    if (equal(currToken, "<")) {  // "<" command
-      tokens[i] = NULL;           // remove operator from tokens
-      fd_in = open(nextToken, O_RDONLY);
-      if (fd_in < 0) {
-        perror(nextToken);
-        _exit(1);
-      }
-      dup2(fd_in, STDIN_FILENO);
-      close(fd_in);
-      i++;                               // next token is file, no need to check
-    } else if (equal(currToken, ">")) {  // ">" command
-      tokens[i] = NULL;                  // remove operator from tokens
-      // char* outputFile = strdup(nextToken);
-      fd_out = open(nextToken, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-      if (fd_out < 0) {
-        perror(currToken);
-        _exit(1);
-      }
-      dup2(fd_out, STDOUT_FILENO);
-      close(fd_out);
-      i++;  // next token is file, no need to check
-    } else if (equal(currToken, "2>")) {  // "2>" command
-      tokens[i] = NULL;                   // remove operator from tokens
-      fd_err = open(nextToken, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
-      if (fd_err < 0) {
-        perror(currToken);
-        _exit(1);
-      }
-      dup2(fd_err, STDERR_FILENO);
-      close(fd_err);
-      i++;  // next token is file, no need to check
-    }
+int runningThreads(Job* job) {
+  int n = 0;
+  for (int i = 0; i < job->numMembers; i++) {
+    if (job->members[i].pid == 0 && job->members[i].state != DONE)
+      n++;
   }
+  return n;
 }
 
 /**
- * @brief execute 1 command via execvp
- *
- * @param cmdTokens parsed command strings
- * @param numToks number of command tokens
- * @param inputCmd original input
- * @param isBackground whether the commands ends with '&'
+ * @brief reap every pending child event in one pass. One waitpid(-1) per
+ * event instead of one per job, so cost follows what changed, not job count.
+ * Builtin threads that finished are collected too
  */
-void executeCommand(char* cmdTokens[],
-                    int numToks,
-                    char* inputCmd,
-                    int isBackground) {
-  pid_t PID = fork();
-  if (PID == 0) {
-    // inside child process
-    // setpgid(0, 0);
-    redirect(cmdTokens, numToks);
-    execvp(cmdTokens[0], cmdTokens);
-    // fprintf(stderr, "BAD COMMAND\n");  // child not supposed to get here
-    _exit(1);
-  } else if (PID > 0) {
-    // TODO: inside parent process
+void reapChildren() {
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+    recordChildStatus(pid, status);
+  }
+  reapBuiltinThreads();
+}
 
-    Job* job = newJob(PID, -1, isBackground, inputCmd);  // job obj of this cmd
+/**
+ * @brief order dirty jobs by job number for printing
+ */
+int compareJobNum(const void* a, const void* b) {
+  return (*(Job* const*)a)->jobNum - (*(Job* const*)b)->jobNum;
+}
 
-    if (!isBackground) {
-      accessTerminalRights(job);
-      foreground = job;
-      waitpid(PID, NULL, WUNTRACED);
-      giveUpTerminalRights(job);
-      foreground = NULL;
-      // delJob(job);
-    } else {
-      giveUpTerminalRights(job);
-      appendJobToStack(job);
-    }
-    // printf("returned to main process\n");
-  } else {
-    // fork failed
-    printf("Fork failure, returned PID=%d\n", PID);
-  }
-}
-
-/**
- * @brief Executes piped input command using execvp calls with this format:
- *        cmd1 | cmd2
- *
- * @param cmd1 parsed left command strings
- * @param cmd1_len numbers of tokens of cmd1
- * @param cmd2 parsed right command strings
- * @param cmd2_len numbers of tokens of cmd2
- * @param inputCmd original input
- * @param isBackground whether the commands ends with '&'
- */
-void executeTwoCommands(char* cmd1[],
-                        int cmd1_len,
-                        char* cmd2[],
-                        int cmd2_len,
-                        char* inputCmd,
-                        int isBackground) {
-  int pfd[2];  // pipe between the two commands. cmd1=>pfd[1], pfd[0]=>cmd2
-  pipe(pfd);
-  pid_t p1 = fork();
-  if (p1 > 0) {
-    // TODO: parent process
-
-  } else if (p1 == 0) {
-    // left cmd
-    setpgid(0, 0);  // create new process group led by left cmd
-    dup2(pfd[1], STDOUT_FILENO);
-    close(pfd[0]);
-    redirect(cmd1, cmd1_len);
-    execvp(cmd1[0], cmd1);
-    // fprintf(stderr, "BAD COMMAND on left side\n");
-    _exit(1);
-  }
-  pid_t p2 = fork();
-  if (p2 == 0) {
-    // right cmd
-    setpgid(0, p1);  // join process group led by left cmd
-    dup2(pfd[0], STDIN_FILENO);
-    close(pfd[1]);
-    redirect(cmd2, cmd2_len);
-    execvp(cmd2[0], cmd2);
-    // fprintf(stderr, "BAD COMMAND on right side\n");
-    _exit(1);
-  }
-  close(pfd[0]);
-  close(pfd[1]);
-  if (p1 < 0 || p2 < 0) {
-    printf("Fork failure, returned pid1=%d, pid2=%d\n", p1, p2);
+/**
+ * @brief report and remove done jobs. Only jobs on the dirty list are looked
+ * at, so a prompt with nothing new costs no stack walk.
+ */
+void updateJobStack() {
+  reapChildren();  // make sure stack is up-to-date
+  if (!dirtyJobs)
     return;
+  // collect what finished, the rest only needs its dirty flag cleared
+  int numDone = 0;
+  for (Job* curr = dirtyJobs; curr; curr = curr->nextDirty) {
+    if (curr->status == DONE)
+      numDone++;
   }
-  Job* job = newJob(p1, p2, isBackground, inputCmd);  // job obj of this cmd
-  if (!isBackground) {
-    accessTerminalRights(job);
-    foreground = job;
-    waitpid(-1 * job->pgid, NULL, WUNTRACED);  // wait for one of them to end
-    waitpid(-1 * job->pgid, NULL, WUNTRACED);  // and the other one
-    giveUpTerminalRights(job);
-    foreground = NULL;
-    // delJob(job);
-  } else {
-    giveUpTerminalRights(job);
-    appendJobToStack(job);
+  Job** done = malloc((numDone + 1) * sizeof(Job*));
+  numDone = 0;
+  while (dirtyJobs) {
+    Job* curr = dirtyJobs;
+    clearJobDirty(curr);
+    if (curr->status == DONE)
+      done[numDone++] = curr;
+  }
+  qsort(done, numDone, sizeof(Job*), compareJobNum);
+
+  OutBuf buf = {0};
+  for (int i = 0; i < numDone; i++) {
+    printJob(&buf, done[i], plusJob);
+    // remove this job from stack and free it
+    removeJobFromStack(done[i]);
+    delJob(done[i]);
   }
-  // printf("returned to main process\n");
+  bufFlush(&buf, STDOUT_FILENO);
+  free(done);
 }
 
+// signalfd carrying SIGCHLD, SIGINT and SIGTSTP. The signals stay blocked
+// for the whole life of yash, so nothing runs asynchronously
+int sigFd = -1;
+
+int notifyMode = FALSE;  // 'set -b': report done jobs right away
+int pipeSize = 0;  // 'set -o pipesize=N': pipeline buffer size, 0 = default
+#define PAR_CHUNK_DEFAULT (1024 * 1024)
+#define PAR_CHUNK_MAX (1024 * 1024 * 1024)
+int parChunk = PAR_CHUNK_DEFAULT;  // 'set -o parchunk=N': '@N' chunk size
+int parOrder = FALSE;  // 'set -o parorder': '@N' output in input order
+
 /**
- * @brief execute shell commands if present. OW return false
- *
- * @param tokens tokenized command input
- * @return boolean TRUE if the first token is one of ['fg', 'bg', 'jobs']
+ * @brief ^C or ^Z at the prompt: drop the line being edited. While a job is
+ * in the foreground the terminal signals the job's group, not yash
  */
-int shellExecute(char* tokens[]) {
-  if (!tokens || !tokens[0]) {
-    // printf("No commands\n");
-    return FALSE;
-  }
-  if (equal(tokens[0], "fg")) {
-    // printf("fg command operation\n");
-    fg();
-    return TRUE;
-  }
-  if (equal(tokens[0], "bg")) {
-    // printf("bg command operation\n");
-    bg();
-    return TRUE;
-  }
-  if (equal(tokens[0], "jobs")) {
-    updateJobStatus();
-    printJobs();
-    return TRUE;
+void handleInterrupt() {
+  // yash must live on to see another command!
+  rl_free_line_state();
+  rl_callback_sigcleanup();
+  printf("\n");
+  rl_replace_line("", 0);
+  rl_on_new_line();
+  rl_redisplay();
+}
+
+/**
+ * @brief print done notices without trashing the line being edited
+ */
+void notifyDoneJobs() {
+  int anyDone = FALSE;
+  for (Job* curr = dirtyJobs; curr; curr = curr->nextDirty) {
+    if (curr->status == DONE)
+      anyDone = TRUE;
   }
-  return FALSE;
+  if (!anyDone)
+    return;
+  rl_clear_visible_line();
+  updateJobStack();
+  rl_forced_update_display();
 }
 
-void tokenize(char* cmd, char* tokenList[], int* numToks, int* pipeIndex) {
-  char* token;
-  while ((token = strtok_r(cmd, " ", &cmd))) {
-    tokenList[*numToks] = token;     // append token to command array
-    if (equal(token, "|")) {         // check if command has a pipe
-      *pipeIndex = *numToks;         // remembers the location of the pipe
-      tokenList[*pipeIndex] = NULL;  // null terminates cmd1
+/**
+ * @brief read everything pending on the signalfd and act on it
+ */
+void handleSignals() {
+  struct signalfd_siginfo info[16];
+  ssize_t n;
+  int gotChild = FALSE;
+  while ((n = read(sigFd, info, sizeof(info))) > 0) {
+    for (int i = 0; i < n / (ssize_t)sizeof(info[0]); i++) {
+      if (info[i].ssi_signo == SIGCHLD)
+        gotChild = TRUE;
+      else
+        handleInterrupt();  // SIGINT or SIGTSTP
     }
-    (*numToks)++;
   }
-  tokenList[*numToks] = NULL;  // null terminate args
+  if (gotChild) {
+    reapChildren();
+    if (notifyMode)
+      notifyDoneJobs();
+  }
 }
 
 /**
- * @brief process the input, tokenize it, and execute them
+ * @brief copy the foreground job's per-stage statuses into $? / PIPESTATUS
  *
- * @param initCmd user input
+ * @param job the job that just left the foreground
  */
-void process(char* inputCmd) {
-  // a copy of input command to mess around with
-  char* cmdCopy = strdup(inputCmd);
-  char* args[MAX_ARGS];
-  int pipeIndex = -1;
-  int isBackground = FALSE;  // 1/TRUE if cmd ends with '&'
-
-  int numArgs = 0;
-  // parses input command string to get args
-  tokenize(cmdCopy, args, &numArgs, &pipeIndex);
-  if (numArgs == 0)
-    return;  // skip this command if its empty
-
-  if (shellExecute(args))
-    return;  // if shell commands finished, skip everything else
-
-  char* lastToken = args[numArgs - 1];
-  if (equal(lastToken, "&")) {
-    // printf("command started from background\n");
-    isBackground = TRUE;
-    args[numArgs - 1] = NULL;  // nullify '&' to not mess up command
-    numArgs--;  // since '&' is gone, total numArgs needs to reflect that
-    // TODO: start job from background
-  }
-
-  if (pipeIndex > 0) {
-    // execute piped commmands
-    char** cmd1 = args;  // cmd1 starts the same as input but ends at pipeIndex
-    char** cmd2 = &args[pipeIndex + 1];  // cmd2 starts after pipeIndex
-    executeTwoCommands(cmd1, pipeIndex, cmd2, numArgs - pipeIndex - 1, inputCmd,
-                       isBackground);
-  } else if (pipeIndex < 0) {
-    // execute regular command
-    executeCommand(args, numArgs, inputCmd, isBackground);
-  } else {
-    fprintf(stderr, "syntax error near unexpected token '|'\n");
+void recordForegroundStatus(Job* job) {
+  if (job->numMembers > pipeStatusCap) {
+    pipeStatusCap = job->numMembers;
+    pipeStatus = realloc(pipeStatus, pipeStatusCap * sizeof(int));
+  }
+  pipeStatusLen = job->numMembers;
+  for (int i = 0; i < pipeStatusLen; i++) {
+    pipeStatus[i] = job->members[i].status;
+    if (job->members[i].state == DONE &&
+        job->members[i].status == 128 + SIGINT)
+      lineInterrupted = TRUE;
+  }
+  lastStatus = pipeStatus[pipeStatusLen - 1];
+  if (job->status == STOPPED) {
+    // a stopped pipeline reports the stop, like bash does
+    for (int i = 0; i < pipeStatusLen; i++) {
+      if (job->members[i].state == STOPPED)
+        lastStatus = job->members[i].status;
+    }
   }
 }
 
 /**
- * @brief handles interrupt ^C
+ * @brief take the terminal back from a foreground job once waiting is over.
+ * A stopped job moves to the stack, a finished one is deleted
+ *
+ * @param job the job that finished or stopped, invalid afterwards unless it
+ * stopped
  */
-void sig_int() {
-  if (foreground) {
-    // only interrupt jobs that aren't yash
-    // fprintf(stderr, "\npressed ctrl+c, interrupt\n");
-
-    // remove fg job. Since fg Job not on stack, no pop needed
-    Job* deadMf = foreground;
-    foreground = NULL;  // give control back to yash
-
-    // yash leaves
-    giveUpTerminalRights(deadMf);
-    kill(-1 * deadMf->pgid, SIGKILL);  // send kill to fg process group
-    delJob(deadMf);
+void leaveForeground(Job* job) {
+  giveUpTerminalRights(job);
+  foreground = NULL;
+  recordForegroundStatus(job);
+  if (job->status == STOPPED) {
+    // ^Z (or any stop signal) parks the job on the stack
+    job->isBackground = TRUE;
+    appendJobToStack(job);
   } else {
-    // printf("\n yash must live on to see another command!\n");
-    printf("\n# ");
+    delJob(job);
   }
 }
 
+int waitJobs(Job* jobs[],
+             int numJobs,
+             const struct timespec* timeout,
+             int interruptible);
+
 /**
- * @brief handles halt ^Z
+ * @brief hand the terminal to a job and wait until every stage exited or one
+ * of them stopped. Uses one blocking waitid(P_PGID) per stage, so the wait
+ * costs exactly as many syscalls as the pipeline has stages. A stopped job
+ * goes onto the stack as a background job. Without job control the stages
+ * share our group, so they are waited for one pid at a time. Builtin
+ * threads have no pid to waitid on, jobs with some go through waitJobs
+ *
+ * @param job the job to run in the foreground (not on the stack)
  */
-void sig_tstp() {
-  if (foreground) {
-    // only pause jobs other than yash
-    // printf("\npressed ctrl+z, interactive stop\n");
+void waitForeground(Job* job) {
+  accessTerminalRights(job);
+  foreground = job;
+  if (runningThreads(job)) {
+    waitJobs(&job, 1, NULL, FALSE);
+    leaveForeground(job);
+    return;
+  }
+
+  int waitFlags = WEXITED | WSTOPPED;
+  while (job->status == RUNNING || waitFlags & WNOHANG) {
+    siginfo_t info;
+    info.si_pid = 0;
+    idtype_t idType = P_PGID;
+    id_t id = job->pgid;
+    if (!jobControl) {
+      idType = P_PID;
+      for (int i = job->numMembers - 1; i >= 0; i--) {
+        if (job->members[i].state == RUNNING)
+          id = job->members[i].pid;
+      }
+    }
+    if (waitid(idType, id, &info, waitFlags) < 0) {
+      if (errno == EINTR)
+        continue;
+      // nothing left to wait for: members were reaped behind our back
+      for (int i = 0; i < job->numMembers; i++) {
+        if (job->members[i].state != DONE)
+          setMemberState(job, i, DONE, 0);
+      }
+      break;
+    }
+    if (info.si_pid == 0)
+      break;  // WNOHANG pass found nothing more
+    int stage;
+    if (findJobByPid(info.si_pid, &stage) != job)
+      continue;  // not a tracked member
+    if (info.si_code == CLD_EXITED)
+      setMemberState(job, stage, DONE, info.si_status);
+    else if (info.si_code == CLD_KILLED || info.si_code == CLD_DUMPED)
+      setMemberState(job, stage, DONE, 128 + info.si_status);
+    else if (info.si_code == CLD_STOPPED)
+      setMemberState(job, stage, STOPPED, 128 + info.si_status);
+    if (job->status == STOPPED)
+      waitFlags |= WNOHANG;  // collect the other stages' stops if already in
+  }
 
-    // place fg process back on top of bg stack
-    Job* retiredMf = foreground;
-    foreground = NULL;  // give control back to yash
+  leaveForeground(job);
+}
 
-    // yash leaves
-    // fprintf(stderr,
-    //         "\tstopping %d, moving yash from group <record:%d, real:%d> ",
-    //         retiredMf->leftChildID, retiredMf->pgid, getpgid(yash));
-    giveUpTerminalRights(retiredMf);
-    // fprintf(stderr, "to group %d. Yash pid=%d\n", getpgid(yash), yash);
-    kill(-1 * retiredMf->pgid, SIGTSTP);  // send stop to fg process group
+#define WAIT_DONE 0         // every job exited
+#define WAIT_DEADLINE 1     // the timeout expired first
+#define WAIT_INTERRUPTED 2  // ^C/^Z at the shell
+#define WAIT_STOPPED 3      // one of the jobs stopped
 
-    retiredMf->status = STOPPED;
-    retiredMf->isBackground = TRUE;
-    appendJobToStack(retiredMf);
-  } else {
-    // printf("\n yash must work hard to process another command!\n");
-    printf("\n# ");
-  }
+/**
+ * @brief pidfd_open(2), which glibc has no wrapper for yet
+ */
+int pidfdOpen(pid_t pid) {
+  return (int)syscall(SYS_pidfd_open, pid, 0);
 }
 
 /**
- * @brief update status of all jobs when a child process ends
+ * @brief parse a duration like "10", "1.5", "30s", "2m", "1h" or "1d"
  *
+ * @param str the duration string
+ * @param out the parsed duration
+ * @return boolean TRUE if str was a valid duration
  */
-void sig_chld() {
-  // fprintf(stderr, "\tCHILD ENDED\t\n");
-  updateJobStatus();
+int parseDuration(const char* str, struct timespec* out) {
+  char* end;
+  double secs = strtod(str, &end);
+  if (end == str || secs < 0)
+    return FALSE;
+  if (equal(end, "m"))
+    secs *= 60;
+  else if (equal(end, "h"))
+    secs *= 3600;
+  else if (equal(end, "d"))
+    secs *= 86400;
+  else if (!equal(end, "") && !equal(end, "s"))
+    return FALSE;
+  out->tv_sec = (time_t)secs;
+  out->tv_nsec = (long)((secs - (double)out->tv_sec) * 1e9);
+  return TRUE;
 }
 
-int main() {
-  signal(SIGTTOU, SIG_IGN);
-  signal(SIGINT, sig_int);
-  signal(SIGTSTP, sig_tstp);
-  signal(SIGCHLD, sig_chld);
-
-  // give terminal control to yash by default
-  pid_t shell = getpid();
-  setpgid(0, 0);
-  tcsetpgrp(0, shell);
-  yash = shell;
-  // yash = newJob(shell, -1, FALSE, NULL);
-  foreground = NULL;
+/**
+ * @brief wait for jobs to finish without polling: one pidfd per live stage,
+ * builtinDonePipe for stages on threads, a timerfd for the deadline and the
+ * signalfd, all in one poll()
+ *
+ * @param jobs the jobs to wait for
+ * @param numJobs how many
+ * @param timeout how long to wait at most, NULL for no limit
+ * @param interruptible whether ^C/^Z at the shell ends the wait
+ * @return int WAIT_DONE, WAIT_DEADLINE, WAIT_INTERRUPTED or WAIT_STOPPED
+ */
+int waitJobs(Job* jobs[],
+             int numJobs,
+             const struct timespec* timeout,
+             int interruptible) {
+  int maxFds = 3;
+  int threads = 0;
+  for (int j = 0; j < numJobs; j++) {
+    maxFds += jobs[j]->numMembers;
+    threads += runningThreads(jobs[j]);
+  }
+  struct pollfd* pfds = malloc(maxFds * sizeof(struct pollfd));
+  Job** owner = malloc(maxFds * sizeof(Job*));
+  int* stageOf = malloc(maxFds * sizeof(int));
+  int numFds = 0;
 
-  while (TRUE) {
-    char* cmd = readline("# ");
-    if (cmd == NULL)
-      _exit(0);
-    if (strlen(cmd) <= 0)
+  pfds[numFds++] = (struct pollfd){sigFd, POLLIN, 0};
+  pfds[numFds++] = (struct pollfd){builtinDonePipe[0], POLLIN, 0};
+  int timerFd = -1;
+  if (timeout) {
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    struct itimerspec spec = {{0, 0}, *timeout};
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+      spec.it_value.tv_nsec = 1;  // zero would disarm the timer
+    timerfd_settime(timerFd, 0, &spec, NULL);
+    pfds[numFds++] = (struct pollfd){timerFd, POLLIN, 0};
+  }
+  int firstPidFd = numFds;
+  for (int j = 0; j < numJobs; j++) {
+    for (int i = 0; i < jobs[j]->numMembers; i++) {
+      if (jobs[j]->members[i].state == DONE || jobs[j]->members[i].pid == 0)
+        continue;
+      int fd = pidfdOpen(jobs[j]->members[i].pid);  // works on zombies too
+      if (fd < 0)
+        continue;
+      owner[numFds] = jobs[j];
+      stageOf[numFds] = i;
+      pfds[numFds++] = (struct pollfd){fd, POLLIN, 0};
+    }
+  }
+
+  int result = WAIT_DONE;
+  int live = numFds - firstPidFd;
+  while (live > 0 || threads > 0) {
+    if (poll(pfds, numFds, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (timerFd >= 0 && pfds[2].revents) {
+      result = WAIT_DEADLINE;
+      break;
+    }
+    if (pfds[1].revents) {
+      reapBuiltinThreads();
+      threads = 0;
+      for (int j = 0; j < numJobs; j++)
+        threads += runningThreads(jobs[j]);
+    }
+    if (pfds[0].revents) {
+      struct signalfd_siginfo info[16];
+      ssize_t n;
+      int gotChild = FALSE, gotInterrupt = FALSE;
+      while ((n = read(sigFd, info, sizeof(info))) > 0) {
+        for (int i = 0; i < n / (ssize_t)sizeof(info[0]); i++) {
+          if (info[i].ssi_signo == SIGCHLD)
+            gotChild = TRUE;
+          else
+            gotInterrupt = TRUE;
+        }
+      }
+      if (gotChild)
+        reapChildren();  // stops, and any other job's children
+      if (gotInterrupt && interruptible) {
+        result = WAIT_INTERRUPTED;
+        break;
+      }
+    }
+    for (int k = firstPidFd; k < numFds; k++) {
+      if (pfds[k].fd < 0)
+        continue;
+      Job* job = owner[k];
+      int stage = stageOf[k];
+      if (pfds[k].revents && job->members[stage].state != DONE) {
+        // exited: reap exactly this stage through its pidfd
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_PIDFD, pfds[k].fd, &info, WEXITED | WNOHANG) == 0 &&
+            info.si_pid != 0) {
+          if (info.si_code == CLD_EXITED)
+            setMemberState(job, stage, DONE, info.si_status);
+          else
+            setMemberState(job, stage, DONE, 128 + info.si_status);
+        }
+      }
+      if (job->members[stage].state == DONE) {
+        close(pfds[k].fd);
+        pfds[k].fd = -1;  // poll skips negative fds
+        live--;
+      }
+    }
+    for (int j = 0; j < numJobs && result == WAIT_DONE; j++) {
+      if (jobs[j]->status == STOPPED)
+        result = WAIT_STOPPED;
+    }
+    if (result != WAIT_DONE)
+      break;
+  }
+
+  for (int k = firstPidFd; k < numFds; k++) {
+    if (pfds[k].fd >= 0)
+      close(pfds[k].fd);
+  }
+  if (timerFd >= 0)
+    close(timerFd);
+  free(pfds);
+  free(owner);
+  free(stageOf);
+  return result;
+}
+
+/**
+ * @brief send a signal to every stage of a job, once. While the group
+ * leader is still unreaped its pid, and so the pgid, can't be recycled:
+ * then one kill of the group reaches the stages and whatever they started.
+ * Otherwise each live stage is signalled through its own pidfd
+ *
+ * @param job the job to signal
+ * @param sig the signal
+ */
+void signalJob(Job* job, int sig) {
+  for (int i = 0; i < job->numMembers && job->pgid > 0; i++) {
+    if (job->members[i].pid != job->pgid || job->members[i].state == DONE)
+      continue;
+    int fd = pidfdOpen(job->pgid);  // pins the leader across the kill
+    if (fd >= 0) {
+      kill(-1 * job->pgid, sig);
+      close(fd);
+      return;
+    }
+  }
+  for (int i = 0; i < job->numMembers; i++) {
+    if (job->members[i].state == DONE || job->members[i].pid <= 0)
+      continue;
+    int fd = pidfdOpen(job->members[i].pid);
+    if (fd >= 0) {
+      syscall(SYS_pidfd_send_signal, fd, sig, NULL, 0);
+      close(fd);
+    }
+  }
+}
+
+/**
+ * @brief foreground wait with a deadline, used by 'timeout'. At the deadline
+ * the job gets SIGTERM, and SIGKILL if it is still around after the grace
+ * period. $? is 124 when the job had to be killed
+ *
+ * @param job the job to run in the foreground (not on the stack)
+ * @param limit how long the job may run
+ * @param grace how long to wait between SIGTERM and SIGKILL
+ */
+void waitForegroundTimed(Job* job,
+                         const struct timespec* limit,
+                         const struct timespec* grace) {
+  accessTerminalRights(job);
+  foreground = job;
+
+  int result = waitJobs(&job, 1, limit, FALSE);
+  int timedOut = (result == WAIT_DEADLINE);
+  if (timedOut) {
+    signalJob(job, SIGTERM);
+    signalJob(job, SIGCONT);  // a stopped job has to run to see SIGTERM
+    if (waitJobs(&job, 1, grace, FALSE) == WAIT_DEADLINE) {
+      signalJob(job, SIGKILL);
+      waitJobs(&job, 1, NULL, FALSE);
+    }
+  }
+
+  leaveForeground(job);
+  if (timedOut)
+    lastStatus = 124;
+}
+
+/**
+ * @brief the 'wait' builtin: wait [-t duration] [%N ...]. Without job specs
+ * waits for every running background job. $? is the status of the last job
+ * waited for, 124 if the -t deadline passed and 130 on ^C
+ *
+ * @param argc number of words
+ * @param tokens the full command, tokens[0] is "wait"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int waitBuiltin(int argc, char* tokens[], int fds[3]) {
+  struct timespec limit;
+  struct timespec* timeout = NULL;
+  int first = 1;
+  if (argc > 1 && equal(tokens[1], "-t")) {
+    if (argc < 3 || !parseDuration(tokens[2], &limit)) {
+      dprintf(fds[2], "wait: -t needs a duration\n");
+      return 2;
+    }
+    timeout = &limit;
+    first = 3;
+  }
+
+  int numJobs = 0;
+  for (int i = first; tokens[i]; i++)
+    numJobs++;
+  int cap = numJobs;
+  if (!numJobs) {
+    for (Job* curr = stack_base; curr; curr = curr->nextJob)
+      cap++;
+  }
+  Job** targets = malloc((cap + 1) * sizeof(Job*));
+  int numTargets = 0;
+  if (numJobs) {
+    for (int i = first; tokens[i]; i++) {
+      Job* job = resolveJobSpec(tokens[i]);
+      if (!job) {
+        dprintf(fds[2], "wait: %s: no such job\n", tokens[i]);
+        continue;
+      }
+      targets[numTargets++] = job;
+    }
+  } else {
+    for (Job* curr = stack_base; curr; curr = curr->nextJob) {
+      if (curr->status == RUNNING)
+        targets[numTargets++] = curr;
+    }
+  }
+
+  int result = waitJobs(targets, numTargets, timeout, TRUE);
+  int status = 0;
+  if (result == WAIT_DEADLINE) {
+    status = 124;
+  } else if (result == WAIT_INTERRUPTED) {
+    dprintf(fds[1], "\n");
+    status = 130;
+  } else if (numTargets > 0) {
+    Job* last = targets[numTargets - 1];
+    status = last->members[last->numMembers - 1].status;
+  }
+  free(targets);
+  return status;
+}
+
+/**
+ * @brief resume latest stopped job to continue in background. assumes stopped
+ * job is already on the stack
+ *
+ * @param target the job to resume, NULL for the latest stopped one
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int bg(Job* target, int fds[3]) {
+  if (!target) {
+    // default to the most recent stopped job
+    for (target = stack_top; target; target = target->prevJob) {
+      if (target->status == STOPPED)
+        break;
+    }
+  }
+  if (!target || target->status != STOPPED) {
+    dprintf(fds[2], "bg: no stopped job found\n");
+    return 1;
+  }
+  if (kill(-1 * target->pgid, SIGCONT) < 0) {
+    // sigcont error occurred
+    dprintf(fds[2], "bg SIGCONT: %s\n", strerror(errno));
+    return 1;
+  }
+  // when successfully resumed the stopped job
+  setJobStatus(target, RUNNING);
+  printJobNoStatus(fds[1], target);
+  return 0;
+}
+
+/**
+ * @brief bring a job on stack to continue/resume in foreground
+ *
+ * @param target the job to resume, NULL for the '+' job
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status, the job's once it ended or stopped
+ */
+int fg(Job* target, int fds[3]) {
+  if (!target)
+    target = getNextJobInLine();
+  if (!target || target->status == DONE) {
+    dprintf(fds[2], "fg: no such job\n");
+    return 1;
+  }
+  if (target->pgid > 0 && kill(-1 * target->pgid, SIGCONT) < 0) {
+    // sigcont error occurred
+    dprintf(fds[2], "fg SIGCONT: %s\n", strerror(errno));
+    return 1;
+  }
+  setJobStatus(target, RUNNING);
+  removeJobFromStack(target);
+
+  dprintf(fds[1], "%s\n", target->jobString);
+  for (int i = 0; i < target->numMembers; i++) {
+    if (target->members[i].state == STOPPED)
+      target->members[i].state = RUNNING;
+  }
+  waitForeground(target);
+  return lastStatus;
+}
+
+/**
+ * @brief undo the shell's signal setup in a freshly forked child. yash keeps
+ * its job control signals blocked (they are read from signalfd), and a
+ * blocked mask survives exec. SIGPIPE stays ignored: the child is still a
+ * shell that may run builtin threads, and what it spawns gets the default
+ */
+void resetChildSignals() {
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTSTP, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGTTOU, SIG_DFL);
+  sigset_t none;
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+}
+
+/**
+ * @brief open the redirection targets of the command onto 0, 1 and 2
+ *
+ * @param cmd the command about to exec
+ */
+void redirect(Command* cmd) {
+  int fd;
+  if (cmd->inFile) {
+    fd = open(cmd->inFile, O_RDONLY);
+    if (fd < 0) {
+      perror(cmd->inFile);
+      _exit(1);
+    }
+    dup2(fd, STDIN_FILENO);
+    close(fd);
+  }
+  if (cmd->outFile) {
+    fd = open(cmd->outFile, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+    if (fd < 0) {
+      perror(cmd->outFile);
+      _exit(1);
+    }
+    dup2(fd, STDOUT_FILENO);
+    close(fd);
+  }
+  if (cmd->errFile) {
+    fd = open(cmd->errFile, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+    if (fd < 0) {
+      perror(cmd->errFile);
+      _exit(1);
+    }
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+  }
+}
+
+// parsed lines kept for reuse, looked up by a hash of the raw line
+#define PLAN_CACHE_SIZE 512     // plans kept, least recently used goes first
+#define PLAN_CACHE_BUCKETS 1024  // power of 2
+
+// a parsed line frozen into one malloc'd block: nodes, argv arrays and
+// words all follow the Plan header. Never modified once built
+typedef struct Plan {
+  unsigned long hash;
+  Ast ast;  // ast.line is the raw line the plan was built from
+  struct Plan* prevUsed;  // LRU order, most recently used first
+  struct Plan* nextUsed;
+  struct Plan* nextInBucket;
+} Plan;
+
+Plan* planBuckets[PLAN_CACHE_BUCKETS];
+Plan* planMostUsed = NULL;
+Plan* planLeastUsed = NULL;
+int numPlans = 0;
+unsigned long planHits = 0;
+unsigned long planMisses = 0;
+const Ast* runningPlan = NULL;  // the line process() is running, never dropped
+
+/**
+ * @brief FNV-1a hash of a command line
+ */
+unsigned long hashLine(const char* line) {
+  unsigned long h = 14695981039346656037ul;
+  for (; *line; line++)
+    h = (h ^ (unsigned char)*line) * 1099511628211ul;
+  return h;
+}
+
+/**
+ * @brief unlink a plan from the LRU list
+ */
+void unlinkPlanUse(Plan* plan) {
+  if (plan->prevUsed)
+    plan->prevUsed->nextUsed = plan->nextUsed;
+  else
+    planMostUsed = plan->nextUsed;
+  if (plan->nextUsed)
+    plan->nextUsed->prevUsed = plan->prevUsed;
+  else
+    planLeastUsed = plan->prevUsed;
+}
+
+/**
+ * @brief put a plan at the front of the LRU list
+ */
+void pushPlanUse(Plan* plan) {
+  plan->prevUsed = NULL;
+  plan->nextUsed = planMostUsed;
+  if (planMostUsed)
+    planMostUsed->prevUsed = plan;
+  else
+    planLeastUsed = plan;
+  planMostUsed = plan;
+}
+
+/**
+ * @brief remove a plan from the cache and free it
+ */
+void dropPlan(Plan* plan) {
+  Plan** link = &planBuckets[plan->hash & (PLAN_CACHE_BUCKETS - 1)];
+  while (*link != plan)
+    link = &(*link)->nextInBucket;
+  *link = plan->nextInBucket;
+  unlinkPlanUse(plan);
+  numPlans--;
+  free(plan);
+}
+
+/**
+ * @brief find the cached plan of a line, counting the hit or miss
+ *
+ * @param line the raw input line
+ * @param hash hashLine(line)
+ * @return Ast* the parsed line, NULL if it isn't cached
+ */
+Ast* lookupPlan(const char* line, unsigned long hash) {
+  Plan* plan = planBuckets[hash & (PLAN_CACHE_BUCKETS - 1)];
+  for (; plan; plan = plan->nextInBucket) {
+    if (plan->hash == hash && equal(plan->ast.line, line)) {
+      planHits++;
+      unlinkPlanUse(plan);
+      pushPlanUse(plan);
+      return &plan->ast;
+    }
+  }
+  planMisses++;
+  return NULL;
+}
+
+/**
+ * @brief copy a string into a plan's word area
+ *
+ * @param text where the next word goes, advanced past the copy
+ * @param word the string (NULL stays NULL)
+ * @return char* the copy
+ */
+char* copyPlanWord(char** text, const char* word) {
+  if (!word)
+    return NULL;
+  size_t len = strlen(word) + 1;
+  char* copy = memcpy(*text, word, len);
+  *text += len;
+  return copy;
+}
+
+/**
+ * @brief freeze a freshly parsed (arena) line into the cache, evicting the
+ * least recently used plan when full
+ *
+ * @param src the parsed line
+ * @param hash hashLine(src->line)
+ * @return Ast* the cached copy, valid until evicted by a later line. The
+ * one in runningPlan is never evicted
+ */
+Ast* cachePlan(const Ast* src, unsigned long hash) {
+  // measure: nodes, then argv slots, then every string
+  size_t numSlots = 0;
+  size_t textBytes = strlen(src->line) + 1;
+  for (int i = 0; i < src->numNodes; i++) {
+    const Command* cmd = &src->nodes[i].cmd;
+    if (cmd->argv) {
+      numSlots += cmd->argc + 1;
+      for (int k = 0; k < cmd->argc; k++)
+        textBytes += strlen(cmd->argv[k]) + 1;
+    }
+    textBytes += cmd->inFile ? strlen(cmd->inFile) + 1 : 0;
+    textBytes += cmd->outFile ? strlen(cmd->outFile) + 1 : 0;
+    textBytes += cmd->errFile ? strlen(cmd->errFile) + 1 : 0;
+  }
+  Plan* plan = malloc(sizeof(Plan) + src->numNodes * sizeof(Node) +
+                      numSlots * sizeof(char*) + textBytes);
+  Node* nodes = (Node*)(plan + 1);
+  char** slots = (char**)(nodes + src->numNodes);
+  char* text = (char*)(slots + numSlots);
+
+  memcpy(nodes, src->nodes, src->numNodes * sizeof(Node));
+  plan->hash = hash;
+  plan->ast = *src;
+  plan->ast.nodes = nodes;
+  plan->ast.line = copyPlanWord(&text, src->line);
+  for (int i = 0; i < src->numNodes; i++) {
+    Command* cmd = &nodes[i].cmd;
+    if (cmd->argv) {
+      char** argv = slots;
+      for (int k = 0; k < cmd->argc; k++) {
+        argv[k] = copyPlanWord(&text, cmd->argv[k]);
+      }
+      argv[cmd->argc] = NULL;
+      cmd->argv = argv;
+      slots += cmd->argc + 1;
+    }
+    cmd->inFile = copyPlanWord(&text, cmd->inFile);
+    cmd->outFile = copyPlanWord(&text, cmd->outFile);
+    cmd->errFile = copyPlanWord(&text, cmd->errFile);
+  }
+
+  if (numPlans == PLAN_CACHE_SIZE) {
+    Plan* victim = planLeastUsed;
+    if (&victim->ast == runningPlan)
+      victim = victim->prevUsed;
+    dropPlan(victim);
+  }
+  Plan** bucket = &planBuckets[hash & (PLAN_CACHE_BUCKETS - 1)];
+  plan->nextInBucket = *bucket;
+  *bucket = plan;
+  pushPlanUse(plan);
+  numPlans++;
+  return &plan->ast;
+}
+
+/**
+ * @brief the 'plancache' builtin: print the plan cache counters, -r empties
+ * the cache (all but the line running it) and resets them
+ *
+ * @param argc number of words
+ * @param tokens the full command, tokens[0] is "plancache"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int planCacheBuiltin(int argc, char* tokens[], int fds[3]) {
+  if (argc > 1 && equal(tokens[1], "-r")) {
+    for (Plan* plan = planMostUsed; plan;) {
+      Plan* next = plan->nextUsed;
+      if (&plan->ast != runningPlan)
+        dropPlan(plan);
+      plan = next;
+    }
+    planHits = 0;
+    planMisses = 0;
+    return 0;
+  }
+  dprintf(fds[1], "%lu hits, %lu misses, %d/%d plans cached\n", planHits,
+          planMisses, numPlans, PLAN_CACHE_SIZE);
+  return 0;
+}
+
+// every builtin takes its words and the fds standing in for 0, 1 and 2, and
+// writes nowhere else. Returns the exit status
+typedef int (*BuiltinFn)(int argc, char* argv[], int fds[3]);
+
+#define BUILTIN_THREAD 1    // touches no shell state, can run on a thread
+#define BUILTIN_SNAPSHOT 2  // only reads shell state: the shell renders the
+                            // output, a thread feeds it into the pipeline
+#define BUILTIN_SLOW 4      // may run for long: never on the shell thread,
+                            // always where ^C can end it
+#define BUILTIN_STDIN 8     // reads stdin when given no files or '-'
+
+typedef struct Builtin {
+  const char* name;
+  BuiltinFn fn;
+  int flags;  // BUILTIN_*, without THREAD or SNAPSHOT it needs a forked shell
+} Builtin;
+
+const Builtin* findBuiltin(const char* name);
+int callBuiltin(const Builtin* builtin, char* argv[], int fds[3]);
+
+// command name -> absolute path cache, shown by the 'hash' builtin
+#define CMD_HASH_BUCKETS 256  // power of 2
+#define CMD_MISS_TTL_MS 2000  // how long "not on PATH" is believed
+#define PATH_CHECK_MS 1000    // PATH directories are re-stat'ed at most this often
+
+typedef struct CmdEntry {
+  char* name;
+  char* path;  // NULL: not found in any PATH directory
+  long expires;  // misses only: when to search again (monotonic ms)
+  unsigned long hits;
+  struct CmdEntry* next;
+} CmdEntry;
+
+CmdEntry* cmdBuckets[CMD_HASH_BUCKETS];
+char* hashedPath = NULL;   // value of PATH the table was filled against
+char** pathDirs = NULL;    // its directories, in search order
+time_t* pathMtimes = NULL;  // mtime of each directory when last checked
+long* pathMtimeNsecs = NULL;
+int numPathDirs = 0;
+long nextPathCheck = 0;
+
+/**
+ * @brief CLOCK_MONOTONIC in milliseconds
+ */
+long monotonicMs() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief drop every remembered command
+ */
+void forgetCommands() {
+  for (int i = 0; i < CMD_HASH_BUCKETS; i++) {
+    while (cmdBuckets[i]) {
+      CmdEntry* entry = cmdBuckets[i];
+      cmdBuckets[i] = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+    }
+  }
+}
+
+/**
+ * @brief drop one remembered command, e.g. after its binary went away
+ */
+void forgetCommand(const char* name) {
+  CmdEntry** link = &cmdBuckets[hashLine(name) & (CMD_HASH_BUCKETS - 1)];
+  for (; *link; link = &(*link)->next) {
+    if (equal((*link)->name, name)) {
+      CmdEntry* entry = *link;
+      *link = entry->next;
+      free(entry->name);
+      free(entry->path);
+      free(entry);
+      return;
+    }
+  }
+}
+
+/**
+ * @brief record the mtime of every PATH directory
+ *
+ * @return boolean TRUE if any of them changed since the last call
+ */
+int statPathDirs() {
+  int changed = FALSE;
+  for (int i = 0; i < numPathDirs; i++) {
+    struct stat st;
+    if (stat(pathDirs[i], &st) < 0)
+      st.st_mtim = (struct timespec){0, 0};
+    if (st.st_mtim.tv_sec != pathMtimes[i] ||
+        st.st_mtim.tv_nsec != pathMtimeNsecs[i])
+      changed = TRUE;
+    pathMtimes[i] = st.st_mtim.tv_sec;
+    pathMtimeNsecs[i] = st.st_mtim.tv_nsec;
+  }
+  return changed;
+}
+
+/**
+ * @brief make sure the table still matches PATH: a new PATH value, or a
+ * PATH directory whose mtime moved (something was added or removed), empties
+ * it. Directories are only re-stat'ed every PATH_CHECK_MS
+ */
+void checkPath() {
+  const char* path = getenv("PATH");
+  if (!path)
+    path = "/bin:/usr/bin";
+  long now = monotonicMs();
+  if (hashedPath && equal(hashedPath, path)) {
+    if (now < nextPathCheck)
+      return;
+    nextPathCheck = now + PATH_CHECK_MS;
+    if (statPathDirs())
+      forgetCommands();
+    return;
+  }
+
+  forgetCommands();
+  free(hashedPath);
+  free(pathDirs);
+  free(pathMtimes);
+  free(pathMtimeNsecs);
+  hashedPath = strdup(path);
+  numPathDirs = 1;
+  for (const char* c = path; *c; c++)
+    numPathDirs += (*c == ':');
+  // the directory strings live in the same block as the pointers
+  pathDirs = malloc(numPathDirs * sizeof(char*) + strlen(path) + 1);
+  char* dirs = strcpy((char*)(pathDirs + numPathDirs), path);
+  for (int i = 0; i < numPathDirs; i++) {
+    pathDirs[i] = dirs;
+    dirs += strcspn(dirs, ":");
+    if (*dirs)
+      *dirs++ = '\0';
+    if (!*pathDirs[i])
+      pathDirs[i] = ".";  // an empty entry means the current directory
+  }
+  pathMtimes = calloc(numPathDirs, sizeof(time_t));
+  pathMtimeNsecs = calloc(numPathDirs, sizeof(long));
+  statPathDirs();
+  nextPathCheck = now + PATH_CHECK_MS;
+}
+
+/**
+ * @brief search the PATH directories for an executable regular file
+ *
+ * @param name command name (no '/')
+ * @return char* malloc'd absolute path, NULL if not found
+ */
+char* searchPath(const char* name) {
+  size_t nameLen = strlen(name);
+  for (int i = 0; i < numPathDirs; i++) {
+    size_t dirLen = strlen(pathDirs[i]);
+    char* candidate = malloc(dirLen + nameLen + 2);
+    memcpy(candidate, pathDirs[i], dirLen);
+    candidate[dirLen] = '/';
+    memcpy(candidate + dirLen + 1, name, nameLen + 1);
+    struct stat st;
+    if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(candidate, X_OK) == 0)
+      return candidate;
+    free(candidate);
+  }
+  return NULL;
+}
+
+/**
+ * @brief resolve a command name to the file to execve, using the table
+ *
+ * @param name argv[0]
+ * @return const char* path to run (name itself if it contains '/'), NULL if
+ * the command is not on PATH
+ */
+const char* hashCommand(const char* name) {
+  if (strchr(name, '/'))
+    return name;
+  checkPath();
+  CmdEntry** bucket = &cmdBuckets[hashLine(name) & (CMD_HASH_BUCKETS - 1)];
+  CmdEntry* entry = *bucket;
+  while (entry && !equal(entry->name, name))
+    entry = entry->next;
+  if (entry && entry->path) {
+    entry->hits++;
+    return entry->path;
+  }
+  if (entry && monotonicMs() < entry->expires)
+    return NULL;  // recent miss
+  if (!entry) {
+    entry = calloc(1, sizeof(CmdEntry));
+    entry->name = strdup(name);
+    entry->next = *bucket;
+    *bucket = entry;
+  }
+  entry->path = searchPath(name);
+  entry->hits = (entry->path != NULL);
+  entry->expires = monotonicMs() + CMD_MISS_TTL_MS;
+  return entry->path;
+}
+
+/**
+ * @brief the 'hash' builtin. No arguments lists the remembered commands,
+ * -r forgets them all, names are looked up and remembered
+ *
+ * @param argc number of words
+ * @param tokens the full command, tokens[0] is "hash"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int hashBuiltin(int argc, char* tokens[], int fds[3]) {
+  if (argc > 1 && equal(tokens[1], "-r")) {
+    forgetCommands();
+    return 0;
+  }
+  if (argc > 1) {
+    int status = 0;
+    for (int i = 1; i < argc; i++) {
+      if (!findBuiltin(tokens[i]) && !hashCommand(tokens[i])) {
+        dprintf(fds[2], "hash: %s: not found\n", tokens[i]);
+        status = 1;
+      }
+    }
+    return status;
+  }
+  checkPath();
+  OutBuf buf = {0};
+  for (int i = 0; i < CMD_HASH_BUCKETS; i++) {
+    for (CmdEntry* entry = cmdBuckets[i]; entry; entry = entry->next) {
+      if (!entry->path)
+        continue;
+      if (!buf.len)
+        bufPrintf(&buf, "hits\tcommand\n");
+      bufPrintf(&buf, "%4lu\t%s\n", entry->hits, entry->path);
+    }
+  }
+  if (!buf.len)
+    bufPrintf(&buf, "hash: hash table empty\n");
+  bufFlush(&buf, fds[1]);
+  return 0;
+}
+
+/**
+ * @brief posix_spawn one resolved binary. glibc implements it with a
+ * vfork-style clone, so the cost doesn't grow with the shell's heap, and
+ * exec errors come back as the return value. Touches no shell state, so the
+ * launcher threads call it too
+ *
+ * @param path the binary to execve
+ * @param cmd the command (redirections become file actions)
+ * @param argv expanded argv of the command
+ * @param inFd becomes stdin, -1 to keep the shell's
+ * @param outFd becomes stdout, -1 to keep the shell's. Pipe fds are all
+ * O_CLOEXEC, so the exec closes every end the command doesn't use
+ * @param pgid group to join, 0 to lead a new one
+ * @param foreground whether a new group takes the terminal. The child does
+ * it before the exec, like forkStage, so it can read the terminal at once
+ * @param pid set to the child
+ * @return int 0, or the errno of the failed spawn
+ */
+int spawnPath(const char* path,
+              Command* cmd,
+              char** argv,
+              int inFd,
+              int outFd,
+              pid_t pgid,
+              int foreground,
+              pid_t* pid) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+#ifdef HAVE_SPAWN_TCSETPGRP
+  // first, while fd 0 is still the terminal and not a redirection
+  if (jobControl && foreground && pgid == 0)
+    posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+  if (inFd >= 0)
+    posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+  if (outFd >= 0)
+    posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+  if (cmd->inFile)
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, cmd->inFile,
+                                     O_RDONLY, 0);
+  if (cmd->outFile)
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, cmd->outFile,
+                                     O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+  if (cmd->errFile)
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, cmd->errFile,
+                                     O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+
+  // same signal state resetChildSignals() gives a forked child
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+  if (jobControl) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attr, pgid);
+  }
+  posix_spawnattr_setflags(&attr, flags);
+  sigset_t none, defaults;
+  sigemptyset(&none);
+  posix_spawnattr_setsigmask(&attr, &none);
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGINT);
+  sigaddset(&defaults, SIGTSTP);
+  sigaddset(&defaults, SIGCHLD);
+  sigaddset(&defaults, SIGTTOU);
+  sigaddset(&defaults, SIGPIPE);  // yash ignores it
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+
+  int err = posix_spawn(pid, path, &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  return err;
+}
+
+/**
+ * @brief start an external command: look the binary up in the command hash
+ * table and spawn it, reporting anything that goes wrong
+ *
+ * @param cmd the command
+ * @param argv expanded argv of the command
+ * @param inFd becomes stdin, -1 to keep the shell's
+ * @param outFd becomes stdout, -1 to keep the shell's
+ * @param pgid group to join, 0 to lead a new one
+ * @param foreground whether a new group takes the terminal
+ * @param failStatus set to 127/126/1 if the command could not be started
+ * @return pid_t the child, -1 if it could not be started (reported)
+ */
+pid_t spawnCommand(Command* cmd,
+                   char** argv,
+                   int inFd,
+                   int outFd,
+                   pid_t pgid,
+                   int foreground,
+                   int* failStatus) {
+  // execve the hashed path directly instead of letting exec walk PATH
+  pid_t pid;
+  const char* path = hashCommand(argv[0]);
+  int err = path ? spawnPath(path, cmd, argv, inFd, outFd, pgid, foreground,
+                             &pid)
+                 : ENOENT;
+  if (err == ENOENT && path && path != argv[0]) {
+    // the remembered binary is gone, search once more
+    forgetCommand(argv[0]);
+    path = hashCommand(argv[0]);
+    err = path ? spawnPath(path, cmd, argv, inFd, outFd, pgid, foreground,
+                           &pid)
+               : ENOENT;
+  }
+  if (err == 0)
+    return pid;
+
+  // a redirection may be what failed: retry the opens here to find out.
+  // Nothing gets truncated, and a missing output file is created like the
+  // child would have
+  const char* badFile = NULL;
+  int fd;
+  if (cmd->inFile && (fd = open(cmd->inFile, O_RDONLY | O_NONBLOCK)) < 0)
+    badFile = cmd->inFile;
+  else if (cmd->inFile)
+    close(fd);
+  const char* outs[2] = {cmd->outFile, cmd->errFile};
+  for (int i = 0; i < 2 && !badFile; i++) {
+    if (!outs[i])
+      continue;
+    if ((fd = open(outs[i], O_WRONLY | O_CREAT | O_NONBLOCK, S_IRWXU)) < 0)
+      badFile = outs[i];
+    else
+      close(fd);
+  }
+  if (badFile) {
+    perror(badFile);
+    *failStatus = 1;
+  } else if (err == ENOENT) {
+    fprintf(stderr, "%s: command not found\n", argv[0]);
+    *failStatus = 127;
+  } else {
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+    *failStatus = 126;
+  }
+  return -1;
+}
+
+// launcher threads that spawn the stages of wide pipelines concurrently
+#define SPAWN_THREADS 4       // pool size, the shell thread helps as well
+#ifndef PARALLEL_SPAWN_MIN
+#define PARALLEL_SPAWN_MIN 4  // narrower pipelines are spawned inline
+#endif
+
+// one stage for the launcher pool. The path is resolved beforehand, so the
+// threads never touch the command hash table
+typedef struct SpawnTask {
+  const char* path;
+  Command* cmd;
+  char** argv;
+  int inFd;
+  int outFd;
+  pid_t pgid;
+  int stage;  // pipeline position, for the caller
+  pid_t pid;  // out
+  int err;    // out: 0 or the spawn's errno
+} SpawnTask;
+
+pthread_mutex_t spawnLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t spawnPosted = PTHREAD_COND_INITIALIZER;    // batch posted
+pthread_cond_t spawnFinished = PTHREAD_COND_INITIALIZER;  // batch done
+SpawnTask* spawnBatch = NULL;
+int spawnBatchSize = 0;
+int spawnNext = 0;     // next task to claim
+int spawnPending = 0;  // claimed or not, tasks not finished yet
+int spawnPoolStarted = FALSE;
+
+/**
+ * @brief claim and run tasks of the posted batch until none are left
+ */
+void drainSpawnBatch() {
+  pthread_mutex_lock(&spawnLock);
+  while (spawnNext < spawnBatchSize) {
+    SpawnTask* task = &spawnBatch[spawnNext++];
+    pthread_mutex_unlock(&spawnLock);
+    task->err = spawnPath(task->path, task->cmd, task->argv, task->inFd,
+                          task->outFd, task->pgid, FALSE, &task->pid);
+    pthread_mutex_lock(&spawnLock);
+    if (--spawnPending == 0)
+      pthread_cond_broadcast(&spawnFinished);
+  }
+  pthread_mutex_unlock(&spawnLock);
+}
+
+/**
+ * @brief launcher thread: sleep until a batch is posted, help drain it
+ */
+void* spawnWorker(void* arg) {
+  pthread_mutex_lock(&spawnLock);
+  while (TRUE) {
+    while (spawnNext >= spawnBatchSize)
+      pthread_cond_wait(&spawnPosted, &spawnLock);
+    pthread_mutex_unlock(&spawnLock);
+    drainSpawnBatch();
+    pthread_mutex_lock(&spawnLock);
+  }
+  return NULL;
+}
+
+/**
+ * @brief spawn a batch of stages concurrently and wait for all of them.
+ * The threads inherit the shell's blocked signals, so job control signals
+ * still only show up on sigFd
+ *
+ * @param tasks the stages
+ * @param numTasks how many
+ */
+void spawnParallel(SpawnTask* tasks, int numTasks) {
+  if (!spawnPoolStarted) {
+    spawnPoolStarted = TRUE;
+    for (int i = 0; i < SPAWN_THREADS; i++) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, spawnWorker, NULL) == 0)
+        pthread_detach(thread);
+    }
+  }
+  pthread_mutex_lock(&spawnLock);
+  spawnBatch = tasks;
+  spawnBatchSize = numTasks;
+  spawnNext = 0;
+  spawnPending = numTasks;
+  pthread_cond_broadcast(&spawnPosted);
+  pthread_mutex_unlock(&spawnLock);
+
+  drainSpawnBatch();
+
+  pthread_mutex_lock(&spawnLock);
+  while (spawnPending > 0)
+    pthread_cond_wait(&spawnFinished, &spawnLock);
+  spawnBatch = NULL;
+  spawnBatchSize = 0;
+  spawnNext = 0;
+  pthread_mutex_unlock(&spawnLock);
+}
+
+/**
+ * @brief parse a byte count like 1048576, 256k or 1m
+ *
+ * @param str the size
+ * @return long bytes, -1 if str is not a size or does not fit a long
+ */
+long parseSize(const char* str) {
+  char* end;
+  errno = 0;
+  long size = strtol(str, &end, 10);
+  if (end == str || size < 0 || errno == ERANGE)
+    return -1;
+  long unit = 1;
+  if (*end == 'k' || *end == 'K') {
+    unit = 1024;
+    end++;
+  } else if (*end == 'm' || *end == 'M') {
+    unit = 1024 * 1024;
+    end++;
+  }
+  if (*end || size > LONG_MAX / unit)
+    return -1;
+  return size * unit;
+}
+
+/**
+ * @brief parse a pipe buffer size like 1048576, 256k or 1m. Capped at
+ * /proc/sys/fs/pipe-max-size, the most an unprivileged process may ask for
+ *
+ * @param str the size
+ * @return int bytes, -1 if str is not a size
+ */
+int parsePipeSize(const char* str) {
+  long size = parseSize(str);
+  if (size < 0)
+    return -1;
+  long max = 1024 * 1024;  // the kernel's default limit
+  FILE* limit = fopen("/proc/sys/fs/pipe-max-size", "r");
+  if (limit) {
+    if (fscanf(limit, "%ld", &max) != 1)
+      max = 1024 * 1024;
+    fclose(limit);
+  }
+  return (int)(size > max ? max : size);
+}
+
+/**
+ * @brief the 'set' builtin. Supports -b/+b, -o/+o notify, -o/+o parorder,
+ * -o parchunk=N/+o parchunk and
+ * -o pipesize=N/+o pipesize; 'set -o' lists
+ *
+ * @param argc number of words
+ * @param tokens the full command, tokens[0] is "set"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int setOptions(int argc, char* tokens[], int fds[3]) {
+  if (argc < 2 || (argc == 2 && equal(tokens[1], "-o"))) {
+    OutBuf buf = {0};
+    bufPrintf(&buf, "notify\t%s\n", notifyMode ? "on" : "off");
+    if (pipeSize > 0)
+      bufPrintf(&buf, "pipesize\t%d\n", pipeSize);
+    else
+      bufPrintf(&buf, "pipesize\tdefault\n");
+    bufPrintf(&buf, "parchunk\t%d\n", parChunk);
+    bufPrintf(&buf, "parorder\t%s\n", parOrder ? "on" : "off");
+    bufFlush(&buf, fds[1]);
+    return 0;
+  }
+  for (int i = 1; tokens[i]; i++) {
+    int on = tokens[i][0] == '-';
+    char* name = tokens[i] + 1;
+    if ((equal(tokens[i], "-o") || equal(tokens[i], "+o")) && tokens[i + 1])
+      name = tokens[++i];
+    if (equal(name, "b") || equal(name, "notify")) {
+      notifyMode = on;
+    } else if (on && strncmp(name, "pipesize=", 9) == 0) {
+      int size = parsePipeSize(name + 9);
+      if (size < 0) {
+        dprintf(fds[2], "set: %s: invalid pipe size\n", name + 9);
+        return 1;
+      }
+      pipeSize = size;
+    } else if (!on && equal(name, "pipesize")) {
+      pipeSize = 0;
+    } else if (on && strncmp(name, "parchunk=", 9) == 0) {
+      long size = parseSize(name + 9);
+      if (size <= 0 || size > PAR_CHUNK_MAX) {
+        dprintf(fds[2], "set: %s: invalid chunk size\n", name + 9);
+        return 1;
+      }
+      parChunk = size;
+    } else if (!on && equal(name, "parchunk")) {
+      parChunk = PAR_CHUNK_DEFAULT;
+    } else if (equal(name, "parorder")) {
+      parOrder = on;
+    } else {
+      dprintf(fds[2], "set: %s: invalid option\n", tokens[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief the 'fg' builtin: fg [%N]
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "fg"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int fgBuiltin(int argc, char* argv[], int fds[3]) {
+  Job* target = NULL;
+  if (argc > 1 && !(target = resolveJobSpec(argv[1]))) {
+    dprintf(fds[2], "fg: %s: no such job\n", argv[1]);
+    return 1;
+  }
+  return fg(target, fds);
+}
+
+/**
+ * @brief the 'bg' builtin: bg [%N]
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "bg"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int bgBuiltin(int argc, char* argv[], int fds[3]) {
+  Job* target = NULL;
+  if (argc > 1 && !(target = resolveJobSpec(argv[1]))) {
+    dprintf(fds[2], "bg: %s: no such job\n", argv[1]);
+    return 1;
+  }
+  return bg(target, fds);
+}
+
+/**
+ * @brief the 'jobs' builtin
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "jobs"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int jobsBuiltin(int argc, char* argv[], int fds[3]) {
+  reapChildren();
+  printJobs(fds[1]);
+  return 0;
+}
+
+/**
+ * @brief the 'cd' builtin: cd [dir | -]. No argument goes to $HOME, '-' to
+ * $OLDPWD. Keeps $PWD and $OLDPWD up to date
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "cd"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int cdBuiltin(int argc, char* argv[], int fds[3]) {
+  if (argc > 2) {
+    dprintf(fds[2], "cd: too many arguments\n");
+    return 1;
+  }
+  const char* dir = argc > 1 ? argv[1] : getenv("HOME");
+  const char* var = "HOME";
+  int printDir = FALSE;
+  if (dir && equal(dir, "-")) {
+    dir = getenv("OLDPWD");
+    var = "OLDPWD";
+    printDir = TRUE;
+  }
+  if (!dir) {
+    dprintf(fds[2], "cd: %s not set\n", var);
+    return 1;
+  }
+  char* old = getcwd(NULL, 0);
+  if (chdir(dir) < 0) {
+    dprintf(fds[2], "cd: %s: %s\n", dir, strerror(errno));
+    free(old);
+    return 1;
+  }
+  char* now = getcwd(NULL, 0);
+  if (old)
+    setenv("OLDPWD", old, 1);
+  if (now) {
+    setenv("PWD", now, 1);
+    if (printDir)
+      dprintf(fds[1], "%s\n", now);
+  }
+  free(old);
+  free(now);
+  return 0;
+}
+
+/**
+ * @brief the 'pwd' builtin
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "pwd"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int pwdBuiltin(int argc, char* argv[], int fds[3]) {
+  char* cwd = getcwd(NULL, 0);
+  if (!cwd) {
+    dprintf(fds[2], "pwd: %s\n", strerror(errno));
+    return 1;
+  }
+  dprintf(fds[1], "%s\n", cwd);
+  free(cwd);
+  return 0;
+}
+
+/**
+ * @brief the 'echo' builtin: echo [-n] words. The line goes out in one write
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "echo"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int echoBuiltin(int argc, char* argv[], int fds[3]) {
+  int first = 1;
+  int newline = TRUE;
+  if (argc > 1 && equal(argv[1], "-n")) {
+    newline = FALSE;
+    first = 2;
+  }
+  OutBuf buf = {0};
+  for (int i = first; i < argc; i++)
+    bufPrintf(&buf, i > first ? " %s" : "%s", argv[i]);
+  if (newline)
+    bufPrintf(&buf, "\n");
+  bufFlush(&buf, fds[1]);
+  return 0;
+}
+
+int trueBuiltin(int argc, char* argv[], int fds[3]) {
+  return 0;
+}
+
+int falseBuiltin(int argc, char* argv[], int fds[3]) {
+  return 1;
+}
+
+/**
+ * @brief whether name can be an environment variable name
+ *
+ * @param name the candidate
+ * @param len its length
+ * @return boolean TRUE if it is letters, digits and '_', not starting with a
+ * digit
+ */
+int isVarName(const char* name, size_t len) {
+  if (len == 0 || isdigit((unsigned char)name[0]))
+    return FALSE;
+  for (size_t i = 0; i < len; i++) {
+    if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * @brief the 'export' builtin: export NAME=value ... puts the variables in
+ * the environment of everything started afterwards. yash has no variables of
+ * its own, so a bare NAME is only checked. No arguments lists the
+ * environment
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "export"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int exportBuiltin(int argc, char* argv[], int fds[3]) {
+  if (argc < 2) {
+    OutBuf buf = {0};
+    for (char** env = environ; *env; env++)
+      bufPrintf(&buf, "export %s\n", *env);
+    bufFlush(&buf, fds[1]);
+    return 0;
+  }
+  int status = 0;
+  for (int i = 1; i < argc; i++) {
+    char* eq = strchr(argv[i], '=');
+    size_t len = eq ? (size_t)(eq - argv[i]) : strlen(argv[i]);
+    if (!isVarName(argv[i], len)) {
+      dprintf(fds[2], "export: `%s': not a valid identifier\n", argv[i]);
+      status = 1;
+      continue;
+    }
+    if (eq) {
+      char* name = strndup(argv[i], len);
+      setenv(name, eq + 1, 1);
+      free(name);
+    }
+  }
+  return status;
+}
+
+/**
+ * @brief the 'exit' builtin: exit [n]. Defaults to $?
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "exit"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int only if n is not a number
+ */
+int exitBuiltin(int argc, char* argv[], int fds[3]) {
+  int status = lastStatus;
+  if (argc > 1) {
+    char* end;
+    long n = strtol(argv[1], &end, 10);
+    if (end == argv[1] || *end) {
+      dprintf(fds[2], "exit: %s: numeric argument required\n", argv[1]);
+      return 2;
+    }
+    status = n & 0xff;
+  }
+  if (jobControl)
+    rl_callback_handler_remove();  // hand the terminal back as it was
+  fflush(stdout);
+  _exit(status);
+}
+
+// bytes asked of the kernel per copy call
+#define COPY_CHUNK (16 * 1024 * 1024)
+
+/**
+ * @brief whether a zero-copy call failed only because it doesn't apply to
+ * these fds, so the next way of copying should be tried
+ *
+ * @param err the errno it failed with
+ * @return boolean TRUE if another method may work
+ */
+int copyUnsupported(int err) {
+  return err == EINVAL || err == ENOSYS || err == EXDEV ||
+         err == EOPNOTSUPP || err == EBADF;
+}
+
+/**
+ * @brief copy everything from in to out, keeping the bytes out of user space
+ * where the kernel allows: copy_file_range between regular files, splice
+ * when either side is a pipe, sendfile from a regular file to anything
+ * else. A read/write loop covers what's left (terminals, sockets to
+ * sockets). Each method picks up where the previous one stopped
+ *
+ * @param in fd to read until EOF
+ * @param out fd to write to
+ * @return int 0, or the errno of the failure
+ */
+int copyFd(int in, int out) {
+  struct stat inSt, outSt;
+  if (fstat(in, &inSt) < 0 || fstat(out, &outSt) < 0)
+    return errno;
+  ssize_t n = -1;
+  if (S_ISREG(inSt.st_mode) && S_ISREG(outSt.st_mode)) {
+    while ((n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0)) > 0 ||
+           (n < 0 && errno == EINTR))
+      ;
+    if (n == 0)
+      return 0;
+    if (!copyUnsupported(errno))
+      return errno;
+  }
+  if (S_ISFIFO(inSt.st_mode) || S_ISFIFO(outSt.st_mode)) {
+    while ((n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE)) > 0 ||
+           (n < 0 && errno == EINTR))
+      ;
+    if (n == 0)
+      return 0;
+    if (!copyUnsupported(errno))
+      return errno;
+  }
+  if (S_ISREG(inSt.st_mode)) {
+    while ((n = sendfile(out, in, NULL, COPY_CHUNK)) > 0 ||
+           (n < 0 && errno == EINTR))
+      ;
+    if (n == 0)
+      return 0;
+    if (!copyUnsupported(errno))
+      return errno;
+  }
+  char buf[65536];
+  while ((n = read(in, buf, sizeof(buf))) != 0) {
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    for (ssize_t off = 0; off < n;) {
+      ssize_t written = write(out, buf + off, n - off);
+      if (written < 0 && errno != EINTR)
+        return errno;
+      if (written > 0)
+        off += written;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief the 'cat' builtin: cat [file | -]... Copies with copyFd, so a file
+ * going into a pipe or another file never passes through yash's memory
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "cat"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int catBuiltin(int argc, char* argv[], int fds[3]) {
+  char* stdinOnly[] = {"-", NULL};
+  char** files = argc > 1 ? argv + 1 : stdinOnly;
+  int status = 0;
+  for (int i = 0; files[i]; i++) {
+    int in = fds[0];
+    if (!equal(files[i], "-")) {
+      in = open(files[i], O_RDONLY | O_CLOEXEC);
+      if (in < 0) {
+        dprintf(fds[2], "cat: %s: %s\n", files[i], strerror(errno));
+        status = 1;
+        continue;
+      }
+    }
+    int err = copyFd(in, fds[1]);
+    if (in != fds[0])
+      close(in);
+    if (err == EPIPE)
+      return 1;  // the reader is gone, the rest would go nowhere
+    if (err) {
+      dprintf(fds[2], "cat: %s: %s\n", files[i], strerror(err));
+      status = 1;
+    }
+  }
+  return status;
+}
+
+/**
+ * @brief copy one file for the 'cp' builtin. The copy gets the source's
+ * permission bits, like a new file made by cp(1)
+ *
+ * @param from source path
+ * @param to destination path, a file
+ * @param errFd where errors go
+ * @return boolean TRUE on success
+ */
+int copyFile(const char* from, const char* to, int errFd) {
+  int in = open(from, O_RDONLY | O_CLOEXEC);
+  struct stat inSt, outSt;
+  if (in < 0 || fstat(in, &inSt) < 0) {
+    dprintf(errFd, "cp: %s: %s\n", from, strerror(errno));
+    if (in >= 0)
+      close(in);
+    return FALSE;
+  }
+  if (S_ISDIR(inSt.st_mode)) {
+    dprintf(errFd, "cp: -r not specified; omitting directory '%s'\n", from);
+    close(in);
+    return FALSE;
+  }
+  if (stat(to, &outSt) == 0 && outSt.st_dev == inSt.st_dev &&
+      outSt.st_ino == inSt.st_ino) {
+    dprintf(errFd, "cp: '%s' and '%s' are the same file\n", from, to);
+    close(in);
+    return FALSE;
+  }
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                 inSt.st_mode & 07777);
+  if (out < 0) {
+    dprintf(errFd, "cp: %s: %s\n", to, strerror(errno));
+    close(in);
+    return FALSE;
+  }
+  int err = copyFd(in, out);
+  close(in);
+  if (close(out) < 0 && !err)
+    err = errno;  // delayed write errors show up here (NFS, quota)
+  if (err) {
+    dprintf(errFd, "cp: %s: %s\n", to, strerror(err));
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * @brief the 'cp' builtin: cp source dest, or cp source... directory.
+ * Regular files only. Copies with copyFd, so file to file is one
+ * copy_file_range loop (a reflink where the filesystem has them)
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "cp"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status
+ */
+int cpBuiltin(int argc, char* argv[], int fds[3]) {
+  if (argc < 3) {
+    dprintf(fds[2], "usage: cp source dest | cp source... directory\n");
+    return 2;
+  }
+  const char* dest = argv[argc - 1];
+  struct stat st;
+  int toDir = stat(dest, &st) == 0 && S_ISDIR(st.st_mode);
+  if (argc > 3 && !toDir) {
+    dprintf(fds[2], "cp: target '%s' is not a directory\n", dest);
+    return 1;
+  }
+  int status = 0;
+  for (int i = 1; i < argc - 1; i++) {
+    if (!toDir) {
+      status |= !copyFile(argv[i], dest, fds[2]);
+      continue;
+    }
+    const char* base = strrchr(argv[i], '/');
+    base = base ? base + 1 : argv[i];
+    size_t len = strlen(dest) + strlen(base) + 2;
+    char* path = malloc(len);
+    snprintf(path, len, "%s/%s", dest, base);
+    status |= !copyFile(argv[i], path, fds[2]);
+    free(path);
+  }
+  return status;
+}
+
+/**
+ * @brief start a command from a forked copy of the shell (no job control):
+ * a builtin in one more fork, anything else spawned. Either way it joins
+ * the caller's process group, and so the caller's job
+ *
+ * @param argv its expanded words
+ * @param inFd becomes stdin, -1 to keep the caller's
+ * @param outFd becomes stdout, -1 to keep the caller's
+ * @param failStatus set to 127/126/1 if it could not be started
+ * @return pid_t the child, -1 if it could not be started (reported)
+ */
+pid_t startChild(char* argv[], int inFd, int outFd, int* failStatus) {
+  const Builtin* builtin = findBuiltin(argv[0]);
+  if (!builtin) {
+    Command bare = {argv};  // the caller's redirections are in place
+    return spawnCommand(&bare, argv, inFd, outFd, 0, FALSE, failStatus);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    resetChildSignals();
+    int fds[3] = {inFd >= 0 ? inFd : STDIN_FILENO,
+                  outFd >= 0 ? outFd : STDOUT_FILENO, STDERR_FILENO};
+    _exit(callBuiltin(builtin, argv, fds));
+  }
+  if (pid < 0) {
+    perror("fork");
+    *failStatus = 1;
+  }
+  return pid;
+}
+
+// exit statuses of the 'xargs' builtin, the same as GNU xargs
+#define XARGS_FAILED 123   // a batch exited with 1 to 125
+#define XARGS_ABORTED 124  // a batch exited with 255, no more were started
+#define XARGS_KILLED 125   // a batch was killed by a signal, same
+
+/**
+ * @brief wait for one batch of the 'xargs' builtin and fold its status in
+ *
+ * @param status the aggregate status so far, raised as needed
+ * @return boolean FALSE if no further batches should start
+ */
+int reapBatch(int* status) {
+  int wstatus;
+  while (waitpid(-1, &wstatus, 0) < 0) {
+    if (errno != EINTR)
+      return FALSE;
+  }
+  int code = 0;
+  if (WIFSIGNALED(wstatus))
+    code = XARGS_KILLED;
+  else if (WEXITSTATUS(wstatus) == 255)
+    code = XARGS_ABORTED;
+  else if (WEXITSTATUS(wstatus) != 0)
+    code = XARGS_FAILED;
+  if (code > *status)
+    *status = code;
+  return code != XARGS_ABORTED && code != XARGS_KILLED;
+}
+
+/**
+ * @brief the 'xargs' builtin: xargs [-0] [-a file] [-n max] [-P procs]
+ * [command [args]]. Reads items, one per line (or NUL separated with -0),
+ * from stdin or the file, and runs the command (echo by default) on as
+ * many at a time as fit in sysconf(_SC_ARG_MAX) next to the environment.
+ * Up to procs batches run at once (0: one per CPU). Runs in a forked copy
+ * of the shell, so every batch lands in the job's process group, and ^Z,
+ * fg and bg act on the whole run
+ *
+ * @param argc number of words
+ * @param argv the full command, argv[0] is "xargs"
+ * @param fds the builtin's stdin, stdout and stderr
+ * @return int exit status: 0 if every batch succeeded, XARGS_* if not,
+ * 126/127 if the command could not be run
+ */
+int xargsBuiltin(int argc, char* argv[], int fds[3]) {
+  int delim = '\n';
+  const char* file = NULL;
+  long maxItems = 0, maxProcs = 1;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+    char opt = argv[i][1];
+    if (equal(argv[i], "--")) {
+      i++;
+      break;
+    }
+    if (equal(argv[i], "-0")) {
+      delim = 0;
+      continue;
+    }
+    char* value = argv[i][2] ? argv[i] + 2 : argv[++i];
+    char* end = NULL;
+    long n = value ? strtol(value, &end, 10) : -1;
+    if (opt == 'a' && value) {
+      file = value;
+    } else if ((opt == 'n' || opt == 'P') && value && !*end && n >= 0) {
+      if (opt == 'n')
+        maxItems = n;
+      else
+        maxProcs = n ? n : sysconf(_SC_NPROCESSORS_ONLN);
+    } else {
+      dprintf(fds[2],
+              "usage: xargs [-0] [-a file] [-n max] [-P procs] [command]\n");
+      return 1;
+    }
+  }
+  char* echo[] = {"echo", NULL};
+  char** words = i < argc ? argv + i : echo;
+  int numWords = i < argc ? argc - i : 1;
+
+  // what exec has room for: ARG_MAX holds the argv and the environment,
+  // with the 2048 bytes POSIX asks to keep spare
+  long budget = sysconf(_SC_ARG_MAX) - 2048;
+  for (char** env = environ; *env; env++)
+    budget -= strlen(*env) + 1 + sizeof(char*);
+  for (int w = 0; w < numWords; w++)
+    budget -= strlen(words[w]) + 1 + sizeof(char*);
+  budget -= sizeof(char*);  // argv's NULL
+  if (budget <= 0) {
+    dprintf(fds[2], "xargs: environment is too large for exec\n");
+    return 1;
+  }
+
+  int inFd = file ? open(file, O_RDONLY | O_CLOEXEC) : dup(fds[0]);
+  FILE* in = inFd >= 0 ? fdopen(inFd, "r") : NULL;
+  if (!in) {
+    dprintf(fds[2], "xargs: %s: %s\n", file ? file : "stdin", strerror(errno));
+    return 1;
+  }
+  // batches must not eat the items: they get stdin only if items are in a
+  // file, like xargs -a
+  int batchIn = file ? fds[0] : open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  char** batch = malloc((numWords + 1) * sizeof(char*));
+  memcpy(batch, words, numWords * sizeof(char*));
+  int batchCap = numWords + 1, batchLen = numWords;
+  long used = 0;
+  char* line = NULL;
+  size_t lineCap = 0;
+  char* carry = NULL;  // the item that didn't fit in the last batch
+  int status = 0, running = 0, more = TRUE, eof = FALSE;
+  while (more) {
+    while (!eof && (maxItems == 0 || batchLen - numWords < maxItems)) {
+      char* item = carry;
+      carry = NULL;
+      if (!item) {
+        ssize_t len = getdelim(&line, &lineCap, delim, in);
+        if (len < 0) {
+          eof = TRUE;
+          break;
+        }
+        if (len > 0 && line[len - 1] == delim)
+          line[--len] = 0;
+        if (len == 0)
+          continue;
+        item = strdup(line);
+      }
+      long cost = strlen(item) + 1 + sizeof(char*);
+      if (used + cost > budget) {
+        if (batchLen == numWords) {
+          dprintf(fds[2], "xargs: item too long for exec: %.40s...\n", item);
+          free(item);
+          status = 1;
+          more = FALSE;
+        } else {
+          carry = item;
+        }
+        break;
+      }
+      if (batchLen + 1 == batchCap) {
+        batchCap *= 2;
+        batch = realloc(batch, batchCap * sizeof(char*));
+      }
+      batch[batchLen++] = item;
+      used += cost;
+    }
+    if (batchLen == numWords)
+      break;  // no more items
+
+    while (running >= maxProcs && more) {
+      more = reapBatch(&status);
+      running--;
+    }
+    if (more) {
+      batch[batchLen] = NULL;
+      int failStatus = 0;
+      if (startChild(batch, batchIn, fds[1], &failStatus) > 0) {
+        running++;
+      } else {
+        status = failStatus == 1 ? 126 : failStatus;
+        more = FALSE;
+      }
+    }
+    while (batchLen > numWords)
+      free(batch[--batchLen]);
+    used = 0;
+  }
+  while (running-- > 0)
+    reapBatch(&status);
+  free(carry);
+  free(line);
+  free(batch);
+  fclose(in);
+  if (!file && batchIn >= 0)
+    close(batchIn);
+  return status;
+}
+
+// builtins by perfect hash: (length + 21 * first + last char) % 32 gives
+// every name its own slot, so a lookup is one hash and one strcmp. Adding a
+// builtin means finding multipliers that keep the names apart
+#define BUILTIN_SLOTS 32  // power of 2
+
+const Builtin builtins[BUILTIN_SLOTS] = {
+    [1] = {"exit", exitBuiltin, 0},
+    [3] = {"export", exportBuiltin, 0},
+    [5] = {"cd", cdBuiltin, 0},
+    [6] = {"set", setOptions, 0},
+    [7] = {"fg", fgBuiltin, 0},
+    [8] = {"false", falseBuiltin, BUILTIN_THREAD},
+    [9] = {"jobs", jobsBuiltin, BUILTIN_SNAPSHOT},
+    [13] = {"true", trueBuiltin, BUILTIN_THREAD},
+    [16] = {"xargs", xargsBuiltin, BUILTIN_SLOW},
+    [17] = {"cp", cpBuiltin, BUILTIN_THREAD | BUILTIN_SLOW},
+    [19] = {"bg", bgBuiltin, 0},
+    [20] = {"hash", hashBuiltin, 0},
+    [22] = {"cat", catBuiltin, BUILTIN_THREAD | BUILTIN_SLOW | BUILTIN_STDIN},
+    [23] = {"pwd", pwdBuiltin, BUILTIN_THREAD},
+    [27] = {"wait", waitBuiltin, 0},
+    [28] = {"echo", echoBuiltin, BUILTIN_THREAD},
+    [30] = {"plancache", planCacheBuiltin, 0},
+};
+
+/**
+ * @brief look up a builtin
+ *
+ * @param name the command name
+ * @return const Builtin* the builtin, NULL if name is not one
+ */
+const Builtin* findBuiltin(const char* name) {
+  size_t len = strlen(name);
+  if (len == 0)
+    return NULL;
+  unsigned slot = (len + 21 * (unsigned char)name[0] +
+                   (unsigned char)name[len - 1]) & (BUILTIN_SLOTS - 1);
+  const Builtin* builtin = &builtins[slot];
+  if (!builtin->name || !equal(builtin->name, name))
+    return NULL;
+  return builtin;
+}
+
+/**
+ * @brief run a builtin with the given fds standing in for 0, 1 and 2
+ *
+ * @param builtin the builtin, from findBuiltin
+ * @param argv its words, NULL terminated
+ * @param fds stdin, stdout and stderr for it
+ * @return int exit status
+ */
+int callBuiltin(const Builtin* builtin, char* argv[], int fds[3]) {
+  int argc = 0;
+  while (argv[argc])
+    argc++;
+  return builtin->fn(argc, argv, fds);
+}
+
+/**
+ * @brief put the shell's own 0, 1 and 2 back after runBuiltinHere
+ *
+ * @param saved copies of the original fds, -1 where nothing was redirected
+ */
+void restoreFds(int saved[3]) {
+  for (int i = 0; i < 3; i++) {
+    if (saved[i] < 0)
+      continue;
+    dup2(saved[i], i);
+    close(saved[i]);
+  }
+}
+
+/**
+ * @brief run a builtin inside the shell, no fork. Its redirections are
+ * opened onto 0, 1 and 2 and the shell's own fds restored afterwards. $?
+ * is set from the result
+ *
+ * @param builtin the builtin, from findBuiltin
+ * @param cmd the command, for its redirections
+ * @param argv its expanded words
+ */
+void runBuiltinHere(const Builtin* builtin, Command* cmd, char* argv[]) {
+  const char* files[3] = {cmd->inFile, cmd->outFile, cmd->errFile};
+  int saved[3] = {-1, -1, -1};
+  fflush(stdout);
+  for (int i = 0; i < 3; i++) {
+    if (!files[i])
+      continue;
+    int fd = i == STDIN_FILENO
+                 ? open(files[i], O_RDONLY)
+                 : open(files[i], O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+    if (fd < 0) {
+      perror(files[i]);
+      restoreFds(saved);
+      lastStatus = 1;
+      return;
+    }
+    saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, i);
+    close(fd);
+  }
+  int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  lastStatus = callBuiltin(builtin, argv, fds);
+  restoreFds(saved);
+}
+
+// bytes a fan-out duplicates per round
+#define FANOUT_CHUNK (1024 * 1024)
+
+/**
+ * @brief read exactly len bytes that are known to be waiting in a pipe
+ *
+ * @return boolean TRUE if they all came
+ */
+int readFully(int fd, char* buf, size_t len) {
+  for (size_t off = 0; off < len;) {
+    ssize_t n = read(fd, buf + off, len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return FALSE;
+    off += n;
+  }
+  return TRUE;
+}
+
+/**
+ * @brief write all of buf, retrying short writes
+ *
+ * @return int 0, or the errno of the failure
+ */
+int writeFully(int fd, const char* buf, size_t len) {
+  for (size_t off = 0; off < len;) {
+    ssize_t n = write(fd, buf + off, len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return errno;
+    off += n;
+  }
+  return 0;
+}
+
+/**
+ * @brief stop feeding a fan-out consumer: it exited (EPIPE) or broke
+ *
+ * @param outs the consumers' fds, the dropped one becomes -1
+ * @param k which one
+ * @param err why, only EPIPE is quiet
+ * @return int 0 for EPIPE, 1 otherwise
+ */
+int dropConsumer(int outs[], int k, int err) {
+  close(outs[k]);
+  outs[k] = -1;
+  if (err == EPIPE)
+    return 0;
+  fprintf(stderr, "fan-out: %s\n", strerror(err));
+  return 1;
+}
+
+/**
+ * @brief copy the pipe in into every consumer pipe in outs until EOF.
+ * Each round tee(2)s what is waiting into all consumers but the last, and
+ * splices the same bytes into the last one, so nothing passes through user
+ * space. Every call blocks on its consumer, so the producer runs at the
+ * pace of the slowest one. A consumer with too little room to take the
+ * whole round gets the rest written from a buffer instead. Consumers that
+ * exit are dropped, once all are gone the producer sees EPIPE
+ *
+ * @param in read end of the producer's pipe
+ * @param outs write ends of the consumers' pipes, dropped ones become -1
+ * @param numOuts how many consumers
+ * @return int exit status: 0, or 1 if a copy failed
+ */
+int fanOut(int in, int outs[], int numOuts) {
+  ssize_t* teed = malloc(numOuts * sizeof(ssize_t));
+  char* buf = NULL;  // only for rounds some consumer took part of
+  int status = 0;
+  while (TRUE) {
+    int first = 0, last = numOuts - 1;
+    while (first < numOuts && outs[first] < 0)
+      first++;
+    while (last >= 0 && outs[last] < 0)
+      last--;
+    if (first > last)
+      break;  // every consumer is gone
+    ssize_t n;
+    if (first == last) {
+      n = splice(in, NULL, outs[last], NULL, FANOUT_CHUNK, SPLICE_F_MOVE);
+      if (n == 0)
+        break;
+      if (n < 0 && errno != EINTR)
+        status |= dropConsumer(outs, last, errno);
+      continue;
+    }
+
+    n = tee(in, outs[first], FANOUT_CHUNK, 0);
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno != EINTR)
+        status |= dropConsumer(outs, first, errno);
+      continue;
+    }
+    int partial = FALSE;
+    for (int k = first + 1; k < last; k++) {
+      teed[k] = n;
+      if (outs[k] < 0)
+        continue;
+      ssize_t m;
+      while ((m = tee(in, outs[k], n, 0)) < 0 && errno == EINTR)
+        ;
+      if (m < 0)
+        status |= dropConsumer(outs, k, errno);
+      else
+        teed[k] = m;
+      partial |= (m >= 0 && m < n);
+    }
+
+    if (partial) {
+      if (!buf)
+        buf = malloc(FANOUT_CHUNK);
+      if (!readFully(in, buf, n)) {
+        status = 1;
+        break;
+      }
+      for (int k = first + 1; k <= last; k++) {
+        size_t from = (k == last ? 0 : teed[k]);
+        int err;
+        if (outs[k] >= 0 && (err = writeFully(outs[k], buf + from, n - from)))
+          status |= dropConsumer(outs, k, err);
+      }
+      continue;
+    }
+    while (n > 0) {
+      ssize_t m = splice(in, NULL, outs[last], NULL, n, SPLICE_F_MOVE);
+      if (m < 0 && errno == EINTR)
+        continue;
+      if (m <= 0)
+        break;
+      n -= m;
+    }
+    if (n > 0) {
+      // the last consumer is gone, the others already have these bytes
+      status |= dropConsumer(outs, last, errno);
+      if (!buf)
+        buf = malloc(FANOUT_CHUNK);
+      if (!readFully(in, buf, n)) {
+        status = 1;
+        break;
+      }
+    }
+  }
+  free(buf);
+  free(teed);
+  return status;
+}
+
+/**
+ * @brief body of a builtin pipeline stage's thread. Runs the builtin (or
+ * copies out its snapshot), closes the fds it owns so the next stage sees
+ * EOF, then hands the task back to the shell thread
+ *
+ * @param arg the BuiltinTask
+ */
+void* builtinWorker(void* arg) {
+  BuiltinTask* task = arg;
+  if (task->snapshotFd >= 0) {
+    struct stat st;
+    off_t off = 0;
+    if (fstat(task->snapshotFd, &st) == 0) {
+      while (off < st.st_size) {
+        ssize_t n = sendfile(task->fds[1], task->snapshotFd, &off,
+                             st.st_size - off);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0)
+          break;  // EPIPE: nobody reads any more
+      }
+    }
+    close(task->snapshotFd);
+  } else if (task->numOuts > 0) {
+    task->status = fanOut(task->fds[0], task->outs, task->numOuts);
+    for (int i = 0; i < task->numOuts; i++) {
+      if (task->outs[i] >= 0)
+        close(task->outs[i]);
+    }
+  } else {
+    task->status = callBuiltin(task->builtin, task->argv, task->fds);
+  }
+  for (int i = 0; i < 3; i++) {
+    if (task->fds[i] > STDERR_FILENO)
+      close(task->fds[i]);
+  }
+  while (write(builtinDonePipe[1], &task, sizeof(task)) < 0 && errno == EINTR)
+    ;
+  return NULL;
+}
+
+/**
+ * @brief whether a builtin stage would read yash's terminal. Only a process
+ * of its own can be stopped with ^C while it waits for input there
+ *
+ * @param builtin the stage's builtin
+ * @param argv its expanded words
+ * @param cmd the stage's command, for its redirections
+ * @param isFirst whether the stage opens the pipeline (no pipe before it)
+ * @return boolean TRUE if the stage would read the terminal
+ */
+int readsTerminal(const Builtin* builtin,
+                  char* argv[],
+                  Command* cmd,
+                  int isFirst) {
+  if (!(builtin->flags & BUILTIN_STDIN) || !isFirst || cmd->inFile ||
+      !isatty(STDIN_FILENO))
+    return FALSE;
+  if (!argv[1])
+    return TRUE;
+  for (int i = 1; argv[i]; i++) {
+    if (equal(argv[i], "-"))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/**
+ * @brief start a builtin pipeline stage on its own thread instead of a
+ * forked shell. The redirections are opened here, and the task takes over
+ * the pipe ends it ends up using. A BUILTIN_SNAPSHOT builtin runs right
+ * now on the shell thread into a memfd, and the thread only copies that out
+ *
+ * @param builtin the builtin, flagged BUILTIN_THREAD or BUILTIN_SNAPSHOT
+ * @param cmd the stage's command, for its redirections
+ * @param argv its expanded words, copied into the task
+ * @param inFd read end of the pipe before the stage, -1 if first
+ * @param outFd write end of the pipe after the stage, -1 if last
+ * @param failStatus set to the stage's status if it could not start
+ * @return BuiltinTask* the running task, NULL if it could not start
+ */
+BuiltinTask* startBuiltinStage(const Builtin* builtin,
+                               Command* cmd,
+                               char* argv[],
+                               int inFd,
+                               int outFd,
+                               int* failStatus) {
+  int argc = 0;
+  size_t textBytes = 0;
+  for (; argv[argc]; argc++)
+    textBytes += strlen(argv[argc]) + 1;
+  BuiltinTask* task =
+      malloc(sizeof(BuiltinTask) + (argc + 1) * sizeof(char*) + textBytes);
+  task->argv = (char**)(task + 1);
+  char* text = (char*)(task->argv + argc + 1);
+  for (int i = 0; i < argc; i++) {
+    task->argv[i] = text;
+    text = stpcpy(text, argv[i]) + 1;
+  }
+  task->argv[argc] = NULL;
+  task->builtin = builtin;
+  task->snapshotFd = -1;
+  task->outs = NULL;
+  task->numOuts = 0;
+  task->status = 0;
+  task->job = NULL;
+  task->stage = -1;
+  task->joined = FALSE;
+
+  const char* files[3] = {cmd->inFile, cmd->outFile, cmd->errFile};
+  task->fds[0] = inFd >= 0 ? inFd : STDIN_FILENO;
+  task->fds[1] = outFd >= 0 ? outFd : STDOUT_FILENO;
+  task->fds[2] = STDERR_FILENO;
+  int opened = 0;  // files[0..opened) were opened over their fds
+  for (; opened < 3; opened++) {
+    if (!files[opened])
+      continue;
+    int fd = opened == STDIN_FILENO
+                 ? open(files[opened], O_RDONLY | O_CLOEXEC)
+                 : open(files[opened], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                        S_IRWXU);
+    if (fd < 0) {
+      perror(files[opened]);
+      break;
+    }
+    task->fds[opened] = fd;
+  }
+
+  int ready = (opened == 3);
+  for (int i = 0; ready && i < 3; i++) {
+    // a later builtin's redirections dup2 over the shell's own standard
+    // fds while this thread may still run, so it gets copies of them
+    if (task->fds[i] != i)
+      continue;
+    task->fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+    if (task->fds[i] < 0) {
+      perror(argv[0]);
+      ready = FALSE;
+    }
+  }
+  if (ready && (builtin->flags & BUILTIN_SNAPSHOT)) {
+    task->snapshotFd = memfd_create("yash-builtin", MFD_CLOEXEC);
+    if (task->snapshotFd < 0) {
+      perror("memfd_create");
+      ready = FALSE;
+    } else {
+      int fds[3] = {task->fds[0], task->snapshotFd, task->fds[2]};
+      task->status = callBuiltin(builtin, task->argv, fds);
+    }
+  }
+  if (ready) {
+    int err = pthread_create(&task->thread, NULL, builtinWorker, task);
+    if (!err)
+      return task;
+    fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+  }
+
+  // the pipe ends stay with the caller, only what was opened here goes
+  for (int i = 0; i < 3; i++) {
+    if (task->fds[i] > STDERR_FILENO && task->fds[i] != inFd &&
+        task->fds[i] != outFd)
+      close(task->fds[i]);
+  }
+  if (task->snapshotFd >= 0)
+    close(task->snapshotFd);
+  free(task);
+  *failStatus = 1;
+  return NULL;
+}
+
+/**
+ * @brief start the thread of a fan-out stage, see fanOut. It owns its
+ * input and every output from here on, even if it could not start
+ *
+ * @param inFd read end of the producer's pipe
+ * @param outs write ends of the consumers' pipes
+ * @param numOuts how many consumers
+ * @param failStatus set to the stage's status if it could not start
+ * @return BuiltinTask* the running task, NULL if it could not start
+ */
+BuiltinTask* startFanOutStage(int inFd,
+                              int outs[],
+                              int numOuts,
+                              int* failStatus) {
+  BuiltinTask* task = calloc(1, sizeof(BuiltinTask) + numOuts * sizeof(int));
+  task->outs = (int*)(task + 1);
+  memcpy(task->outs, outs, numOuts * sizeof(int));
+  task->numOuts = numOuts;
+  task->fds[0] = inFd;
+  task->fds[1] = -1;  // writes only to outs, never the shell's stdout
+  task->fds[2] = -1;
+  task->snapshotFd = -1;
+  task->stage = -1;
+  int err = builtinDonePipe[1] < 0
+                ? EAGAIN
+                : pthread_create(&task->thread, NULL, builtinWorker, task);
+  if (!err)
+    return task;
+  fprintf(stderr, "fan-out: %s\n", strerror(err));
+  for (int i = 0; i < numOuts; i++)
+    close(outs[i]);
+  free(task);
+  *failStatus = 1;
+  return NULL;
+}
+
+// per-command arena: chunks of at least ARENA_CHUNK bytes, bump allocated
+#define ARENA_CHUNK 16384
+
+typedef struct ArenaChunk {
+  struct ArenaChunk* next;  // older chunk
+  size_t used;
+  size_t cap;
+  char data[];
+} ArenaChunk;
+
+typedef struct Arena {
+  ArenaChunk* head;  // newest chunk, allocations come from here
+} Arena;
+
+// everything that only lives while one command line is dispatched (the
+// token copy, argv...). Reset in one shot once the line is done
+Arena cmdArena = {NULL};
+
+/**
+ * @brief bump-allocate from an arena, adding a chunk when the current one is
+ * full
+ *
+ * @param arena the arena
+ * @param size bytes wanted
+ * @return void* memory valid until the next arenaReset
+ */
+void* arenaAlloc(Arena* arena, size_t size) {
+  size = (size + 15) & ~(size_t)15;  // keep everything 16-byte aligned
+  ArenaChunk* chunk = arena->head;
+  if (!chunk || chunk->used + size > chunk->cap) {
+    size_t cap = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+    chunk = malloc(sizeof(ArenaChunk) + cap);
+    chunk->used = 0;
+    chunk->cap = cap;
+    chunk->next = arena->head;
+    arena->head = chunk;
+  }
+  void* mem = chunk->data + chunk->used;
+  chunk->used += size;
+  return mem;
+}
+
+/**
+ * @brief strdup into an arena
+ *
+ * @param arena the arena
+ * @param str string to copy
+ * @return char* the copy, valid until the next arenaReset
+ */
+char* arenaStrdup(Arena* arena, const char* str) {
+  size_t len = strlen(str) + 1;
+  char* copy = arenaAlloc(arena, len);
+  memcpy(copy, str, len);
+  return copy;
+}
+
+/**
+ * @brief release everything allocated from an arena. The oldest chunk is
+ * kept so steady state needs no malloc at all
+ *
+ * @param arena the arena
+ */
+void arenaReset(Arena* arena) {
+  while (arena->head && arena->head->next) {
+    ArenaChunk* chunk = arena->head;
+    arena->head = chunk->next;
+    free(chunk);
+  }
+  if (arena->head)
+    arena->head->used = 0;
+}
+
+/**
+ * @brief fill in a word template (see PARAM_MARK) with the current $? and
+ * $PIPESTATUS
+ *
+ * @param word the template, after its leading PARAM_MARK
+ * @return char* the expanded word (arena allocated)
+ */
+char* expandWord(const char* word) {
+  size_t size = 1;
+  for (const char* p = word; *p; p++) {
+    if (*p != PARAM_MARK)
+      size++;
+    else if (*++p == PARAM_MARK)
+      size++;
+    else
+      size += 12 * (pipeStatusLen + 1);  // enough for $? too
+  }
+  char* out = arenaAlloc(&cmdArena, size);
+  size_t len = 0;
+  for (const char* p = word; *p; p++) {
+    if (*p != PARAM_MARK) {
+      out[len++] = *p;
+    } else if (*++p == PARAM_STATUS) {
+      len += snprintf(out + len, size - len, "%d", lastStatus);
+    } else if (*p == PARAM_PIPESTATUS) {
+      for (int k = 0; k < pipeStatusLen; k++)
+        len += snprintf(out + len, size - len, k ? " %d" : "%d",
+                        pipeStatus[k]);
+    } else {
+      out[len++] = PARAM_MARK;
+    }
+  }
+  out[len] = '\0';
+  return out;
+}
+
+/**
+ * @brief expand the special parameters $? and $PIPESTATUS, anywhere in a
+ * word outside single quotes
+ *
+ * @param cmd the command about to run
+ * @return char** argv with the parameters replaced (arena copy), or the
+ * command's own argv if it has none
+ */
+char** expandArgv(Command* cmd) {
+  if (!cmd->expand)
+    return cmd->argv;
+  char** argv = arenaAlloc(&cmdArena, (cmd->argc + 1) * sizeof(char*));
+  for (int i = 0; i <= cmd->argc; i++) {
+    argv[i] = cmd->argv[i];
+    if (argv[i] && argv[i][0] == PARAM_MARK)
+      argv[i] = expandWord(argv[i] + 1);
+  }
+  return argv;
+}
+
+// character classes for the lexer
+#define LEX_WORD 0   // ordinary word byte
+#define LEX_BLANK 1  // separates tokens
+#define LEX_OP 2     // starts an operator, also ends a word
+#define LEX_QUOTE 3  // ' " or backslash, the word needs unquoting
+
+static const unsigned char lexClass[256] = {
+    [' '] = LEX_BLANK, ['\t'] = LEX_BLANK, ['\n'] = LEX_BLANK,
+    ['|'] = LEX_OP,    ['&'] = LEX_OP,     ['<'] = LEX_OP,
+    ['>'] = LEX_OP,    [';'] = LEX_OP,     ['('] = LEX_OP,
+    [')'] = LEX_OP,    ['\''] = LEX_QUOTE, ['"'] = LEX_QUOTE,
+    ['\\'] = LEX_QUOTE,
+};
+
+/**
+ * @brief skip ordinary word bytes one at a time
+ *
+ * @param line the input line
+ * @param i where to start
+ * @param len length of the line
+ * @return size_t offset of the first byte that isn't LEX_WORD (or len)
+ */
+size_t scanWordScalar(const char* line, size_t i, size_t len) {
+  while (i < len && lexClass[(unsigned char)line[i]] == LEX_WORD)
+    i++;
+  return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// bytes that end a run of word bytes: blanks, operators and quotes. '2' only
+// matters at the start of a token, which the lexer checks itself
+#define SCAN_STOP_BYTES " \t\n|&<>;()'\"\\"
+#define SCAN_NUM_STOP (sizeof(SCAN_STOP_BYTES) - 1)
+
+// each stop byte repeated 16 times, filled in by selectWordScanner() so
+// scanWordSse2 just loads them
+unsigned char scanStop[SCAN_NUM_STOP][16] __attribute__((aligned(16)));
+
+/**
+ * @brief scan up to 16 bytes with scanWordScalar first. Most words end
+ * there, and for those the vector setup costs more than it saves
+ *
+ * @param line the input line
+ * @param i where to start, moved past the bytes scanned
+ * @param len length of the line
+ * @return int TRUE if the word goes on past them
+ */
+int scanWordHead(const char* line, size_t* i, size_t len) {
+  size_t head = *i + 16 < len ? *i + 16 : len;
+  *i = scanWordScalar(line, *i, head);
+  return *i == head && head < len;
+}
+
+/**
+ * @brief scanWordScalar, 16 bytes per step with SSE2 compares
+ */
+__attribute__((target("sse2"))) size_t scanWordSse2(const char* line,
+                                                     size_t i,
+                                                     size_t len) {
+  if (!scanWordHead(line, &i, len))
+    return i;
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i*)(line + i));
+    __m128i hit = _mm_setzero_si128();
+    for (size_t k = 0; k < SCAN_NUM_STOP; k++)
+      hit = _mm_or_si128(
+          hit, _mm_cmpeq_epi8(chunk, _mm_load_si128((__m128i*)scanStop[k])));
+    unsigned int mask = _mm_movemask_epi8(hit);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return scanWordScalar(line, i, len);
+}
+
+// SCAN_STOP_BYTES as two nibble lookups: a byte stops a word when the bits
+// for its low nibble and for its high nibble overlap. One bit per high
+// nibble that has stop bytes: 0x0_ 1, 0x2_ 2, 0x3_ 4, 0x5_ 8, 0x7_ 16. Both
+// 16 byte lanes hold the same table, since vpshufb looks up per lane
+#define SCAN_LOW_NIBBLES                                                  \
+  2, 0, 2, 0, 0, 0, 2, 2, 2, 3, 1, 4, 4 | 8 | 16, 0, 4, 0
+#define SCAN_HIGH_NIBBLES 1, 0, 2, 4, 0, 8, 0, 16, 0, 0, 0, 0, 0, 0, 0, 0
+static const unsigned char scanLowNibble[32] __attribute__((aligned(32))) = {
+    SCAN_LOW_NIBBLES, SCAN_LOW_NIBBLES};
+static const unsigned char scanHighNibble[32] __attribute__((aligned(32))) = {
+    SCAN_HIGH_NIBBLES, SCAN_HIGH_NIBBLES};
+
+/**
+ * @brief scanWordScalar, 32 bytes per step with AVX2 nibble lookups
+ */
+__attribute__((target("avx2"))) size_t scanWordAvx2(const char* line,
+                                                     size_t i,
+                                                     size_t len) {
+  if (!scanWordHead(line, &i, len))
+    return i;
+  __m256i lowTable = _mm256_load_si256((__m256i*)scanLowNibble);
+  __m256i highTable = _mm256_load_si256((__m256i*)scanHighNibble);
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i*)(line + i));
+    __m256i low = _mm256_shuffle_epi8(lowTable, _mm256_and_si256(chunk, nibble));
+    __m256i high = _mm256_shuffle_epi8(
+        highTable, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble));
+    __m256i word = _mm256_cmpeq_epi8(_mm256_and_si256(low, high),
+                                     _mm256_setzero_si256());
+    unsigned int mask = ~_mm256_movemask_epi8(word);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return scanWordScalar(line, i, len);
+}
+#endif
+
+// word scanner picked for this CPU by selectWordScanner()
+size_t (*scanWord)(const char*, size_t, size_t) = scanWordScalar;
+
+/**
+ * @brief pick the widest word scanner the CPU supports. Built with
+ * -DSCALAR_SCAN, yash keeps the scalar one (the baseline for make bench)
+ */
+void selectWordScanner() {
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(SCALAR_SCAN)
+  for (size_t k = 0; k < SCAN_NUM_STOP; k++)
+    memset(scanStop[k], SCAN_STOP_BYTES[k], sizeof(scanStop[k]));
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    scanWord = scanWordAvx2;
+  else if (__builtin_cpu_supports("sse2"))
+    scanWord = scanWordSse2;
+#endif
+}
+
+/**
+ * @brief single pass lexer. Splits the line into token spans without copying
+ * or modifying it. Operators don't need blanks around them
+ *
+ * @param line the input line
+ * @param outTokens set to the token array (arena allocated)
+ * @return int number of tokens, -1 on an unterminated quote
+ */
+int tokenize(const char* line, Token** outTokens) {
+  int cap = 16;
+  int num = 0;
+  Token* tokens = arenaAlloc(&cmdArena, cap * sizeof(Token));
+  size_t len = strlen(line);  // vector loads never go past the NUL
+  int i = 0;
+  while (TRUE) {
+    while (lexClass[(unsigned char)line[i]] == LEX_BLANK)
+      i++;
+    if (!line[i])
+      break;
+    if (num == cap) {
+      // grow geometrically so a huge line stays linear
+      Token* bigger = arenaAlloc(&cmdArena, 2 * cap * sizeof(Token));
+      memcpy(bigger, tokens, cap * sizeof(Token));
+      tokens = bigger;
+      cap *= 2;
+    }
+    Token* tok = &tokens[num++];
+    tok->start = i;
+    tok->quoted = FALSE;
+    char c = line[i];
+    if (c == '|' && line[i + 1] == '|') {
+      tok->type = TOK_OR_IF;
+      i += 2;
+    } else if (c == '|' && line[i + 1] == '>') {
+      tok->type = TOK_FANOUT;
+      i += 2;
+    } else if (c == '|') {
+      tok->type = TOK_PIPE;
+      i++;
+    } else if (c == '&' && line[i + 1] == '&') {
+      tok->type = TOK_AND_IF;
+      i += 2;
+    } else if (c == '&') {
+      tok->type = TOK_AMP;
+      i++;
+    } else if (c == ';') {
+      tok->type = TOK_SEMI;
+      i++;
+    } else if (c == '(') {
+      tok->type = TOK_LPAREN;
+      i++;
+    } else if (c == ')') {
+      tok->type = TOK_RPAREN;
+      i++;
+    } else if (c == '<') {
+      tok->type = TOK_LESS;
+      i++;
+    } else if (c == '>') {
+      tok->type = TOK_GREAT;
+      i++;
+    } else if (c == '2' && line[i + 1] == '>') {
+      tok->type = TOK_ERRGREAT;
+      i += 2;
+    } else {
+      tok->type = TOK_WORD;
+      while (TRUE) {
+        i = scanWord(line, i, len);  // jump over the plain part of the word
+        if (lexClass[(unsigned char)line[i]] != LEX_QUOTE)
+          break;  // blank, operator or end of line
+        tok->quoted = TRUE;
+        char q = line[i++];
+        if (q == '\\') {
+          if (line[i])
+            i++;
+          continue;
+        }
+        // skip to the closing quote, \ only escapes inside "..."
+        if (q == '\'') {
+          const char* close = memchr(line + i, q, len - i);
+          i = close ? close - line : (int)len;
+        }
+        while (line[i] && line[i] != q) {
+          if (q == '"' && line[i] == '\\' && line[i + 1])
+            i++;
+          i++;
+        }
+        if (!line[i]) {
+          fprintf(stderr, "syntax error: unterminated %c\n", q);
+          return -1;
+        }
+        i++;
+      }
+    }
+    tok->len = i - tok->start;
+  }
+  *outTokens = tokens;
+  return num;
+}
+
+/**
+ * @brief copy a word token out of the line, dropping its quotes
+ *
+ * @param line the input line
+ * @param tok a TOK_WORD token
+ * @param out where the NUL terminated word goes (at least len+1 bytes)
+ * @return char* first byte after the copied word's NUL
+ */
+char* unquoteWord(const char* line, Token* tok, char* out) {
+  const char* p = line + tok->start;
+  const char* end = p + tok->len;
+  if (!tok->quoted) {
+    memcpy(out, p, tok->len);
+    out[tok->len] = '\0';
+    return out + tok->len + 1;
+  }
+  while (p < end) {
+    char c = *p++;
+    if (c == '\\') {
+      if (p < end)
+        *out++ = *p++;
+    } else if (c == '\'') {
+      while (*p != '\'')
+        *out++ = *p++;
+      p++;
+    } else if (c == '"') {
+      while (*p != '"') {
+        if (*p == '\\' && strchr("\\\"$`", p[1]))
+          p++;
+        *out++ = *p++;
+      }
+      p++;
+    } else {
+      *out++ = c;
+    }
+  }
+  *out++ = '\0';
+  return out;
+}
+
+/**
+ * @brief whether a word may have to become a template: it has a '$' or a
+ * PARAM_MARK byte. Such words get twice their length in the parser's text
+ *
+ * @param line the input line
+ * @param tok a TOK_WORD token
+ * @return boolean TRUE if unquoteArg must look at it closely
+ */
+int mayNeedTemplate(const char* line, Token* tok) {
+  return memchr(line + tok->start, '$', tok->len) ||
+         memchr(line + tok->start, PARAM_MARK, tok->len);
+}
+
+/**
+ * @brief whether a special parameter starts here: $?, ${?}, $PIPESTATUS or
+ * ${PIPESTATUS}
+ *
+ * @param p where a '$' may be
+ * @param end end of the word
+ * @param kind set to PARAM_STATUS or PARAM_PIPESTATUS
+ * @return int bytes the reference takes, 0 if there is none
+ */
+int paramRef(const char* p, const char* end, char* kind) {
+  static const char* refs[] = {"$?", "${?}", "$PIPESTATUS", "${PIPESTATUS}"};
+  for (int i = 0; i < 4; i++) {
+    size_t len = strlen(refs[i]);
+    if ((size_t)(end - p) < len || strncmp(p, refs[i], len))
+      continue;
+    if (i == 2 && p + len < end && (isalnum((unsigned char)p[len]) ||
+                                    p[len] == '_'))
+      continue;  // some other variable, like $PIPESTATUS_2
+    *kind = i < 2 ? PARAM_STATUS : PARAM_PIPESTATUS;
+    return len;
+  }
+  return 0;
+}
+
+/**
+ * @brief copy an argument out of the line like unquoteWord. One that refers
+ * to $? or $PIPESTATUS outside single quotes, or starts with a PARAM_MARK
+ * byte, is written as a template instead (see PARAM_MARK)
+ *
+ * @param line the input line
+ * @param tok a TOK_WORD token
+ * @param out where the word goes (2*len+2 bytes if mayNeedTemplate)
+ * @param isTemplate set to TRUE if a template was written
+ * @return char* first byte after the word's NUL
+ */
+char* unquoteArg(const char* line, Token* tok, char* out, int* isTemplate) {
+  *isTemplate = FALSE;
+  if (!mayNeedTemplate(line, tok))
+    return unquoteWord(line, tok, out);
+  const char* p = line + tok->start;
+  const char* end = p + tok->len;
+  char* t = out;
+  char quote = 0;
+  *t++ = PARAM_MARK;
+  while (p < end) {
+    char c = *p;
+    char kind;
+    int n = c == '$' && quote != '\'' ? paramRef(p, end, &kind) : 0;
+    if (n) {
+      *t++ = PARAM_MARK;
+      *t++ = kind;
+      p += n;
+      *isTemplate = TRUE;
+      continue;
+    }
+    p++;
+    if (quote && c == quote) {
+      quote = 0;
+      continue;
+    }
+    if (!quote && (c == '\'' || c == '"')) {
+      quote = c;
+      continue;
+    }
+    // \ escapes anything outside quotes, only \ " $ ` inside "..."
+    if (c == '\\' && quote != '\'' && p < end &&
+        (!quote || strchr("\\\"$`", *p)))
+      c = *p++;
+    if (c == PARAM_MARK)
+      *t++ = PARAM_MARK;
+    *t++ = c;
+  }
+  *t++ = '\0';
+  if (*isTemplate || out[1] == PARAM_MARK) {
+    *isTemplate = TRUE;
+    return t;
+  }
+  return unquoteWord(line, tok, out);
+}
+
+/**
+ * @brief report a syntax error at a token (NULL = end of line)
+ *
+ * @param line the input line
+ * @param tok offending token
+ */
+void syntaxError(const char* line, Token* tok) {
+  if (tok)
+    fprintf(stderr, "syntax error near unexpected token '%.*s'\n", tok->len,
+            line + tok->start);
+  else
+    fprintf(stderr, "syntax error near unexpected token 'newline'\n");
+}
+
+// state of the recursive-descent parser
+typedef struct Parser {
+  Ast* ast;
+  Token* tokens;
+  int numTokens;
+  int pos;  // next token to look at
+  int capNodes;
+  char** slots;  // free argv slots, handed out in order
+  char* text;    // free room for unquoted words, handed out in order
+  int inFanOut;  // parsing the consumers of a fan-out: ',' and '}' end them
+  int sawComma;  // the last simple command ended in a ',' separator
+} Parser;
+
+/**
+ * @brief the next token, NULL at the end of the line
+ */
+Token* peekToken(Parser* p) {
+  return p->pos < p->numTokens ? &p->tokens[p->pos] : NULL;
+}
+
+/**
+ * @brief whether tok is the reserved word { or } (only special where a
+ * command may start, otherwise it's an ordinary word)
+ */
+int isKeyword(Parser* p, Token* tok, char c) {
+  return tok && tok->type == TOK_WORD && tok->len == 1 &&
+         p->ast->line[tok->start] == c;
+}
+
+/**
+ * @brief whether tok starts a redirection
+ */
+int isRedirect(Token* tok) {
+  return tok && (tok->type == TOK_LESS || tok->type == TOK_GREAT ||
+                 tok->type == TOK_ERRGREAT);
+}
+
+/**
+ * @brief node by index. Node pointers go stale whenever a node is added
+ */
+Node* nodeAt(Parser* p, int idx) {
+  return &p->ast->nodes[idx];
+}
+
+/**
+ * @brief append a blank node to the flat node array
+ *
+ * @param p the parser
+ * @param type NODE_*
+ * @param start offset of the node's text in the line
+ * @return int index of the node
+ */
+int newNode(Parser* p, int type, int start) {
+  Ast* ast = p->ast;
+  if (ast->numNodes == p->capNodes) {
+    Node* bigger = arenaAlloc(&cmdArena, 2 * p->capNodes * sizeof(Node));
+    memcpy(bigger, ast->nodes, p->capNodes * sizeof(Node));
+    ast->nodes = bigger;
+    p->capNodes *= 2;
+  }
+  Node* node = &ast->nodes[ast->numNodes];
+  memset(node, 0, sizeof(Node));
+  node->type = type;
+  node->child = -1;
+  node->next = -1;
+  node->start = start;
+  return ast->numNodes++;
+}
+
+/**
+ * @brief end a node's text at the last token consumed
+ */
+void endNode(Parser* p, int idx) {
+  Token* last = &p->tokens[p->pos - 1];
+  nodeAt(p, idx)->len = last->start + last->len - nodeAt(p, idx)->start;
+}
+
+/**
+ * @brief whether a word ends in a ',' that separates fan-out consumers: the
+ * last character, unquoted and not escaped
+ */
+int endsInComma(Parser* p, Token* tok) {
+  const char* raw = p->ast->line + tok->start;
+  return raw[tok->len - 1] == ',' &&
+         (tok->len == 1 || raw[tok->len - 2] != '\\');
+}
+
+/**
+ * @brief whether a word is '},': the end of a nested fan-out followed by the
+ * ',' ending the consumer it is in
+ */
+int isCloseComma(Parser* p, Token* tok) {
+  return tok && tok->type == TOK_WORD && tok->len == 2 &&
+         !strncmp(p->ast->line + tok->start, "},", 2);
+}
+
+/**
+ * @brief redirection: operator and file name. Inside a fan-out a trailing
+ * ',' on the name ends the consumer, like on any other word
+ *
+ * @param p the parser, at the operator
+ * @param cmd gets the target
+ * @return boolean FALSE on a syntax error
+ */
+int parseRedirect(Parser* p, Command* cmd) {
+  Token* op = &p->tokens[p->pos++];
+  Token* file = peekToken(p);
+  if (!file || file->type != TOK_WORD) {
+    syntaxError(p->ast->line, file);
+    return FALSE;
+  }
+  p->pos++;
+  char* word = p->text;
+  p->text = unquoteWord(p->ast->line, file, p->text);
+  if (p->inFanOut && endsInComma(p, file)) {
+    word[strlen(word) - 1] = 0;
+    p->sawComma = TRUE;
+  }
+  if (op->type == TOK_LESS)
+    cmd->inFile = word;
+  else if (op->type == TOK_GREAT)
+    cmd->outFile = word;
+  else
+    cmd->errFile = word;
+  return TRUE;
+}
+
+/**
+ * @brief simple command: words and redirections, in any order. Inside a
+ * fan-out a trailing ',' or a '}' also ends it
+ *
+ * @return int node index, -1 on a syntax error
+ */
+int parseSimple(Parser* p) {
+  Token* tok = peekToken(p);
+  int idx = newNode(p, NODE_CMD, tok ? tok->start : 0);
+  Command* cmd = &nodeAt(p, idx)->cmd;
+  cmd->argv = p->slots;
+  while ((tok = peekToken(p))) {
+    if (isRedirect(tok)) {
+      if (!parseRedirect(p, cmd))
+        return -1;
+      if (p->sawComma)
+        break;
+      continue;
+    }
+    if (tok->type != TOK_WORD)
+      break;
+    if (p->inFanOut && (isKeyword(p, tok, '}') || isKeyword(p, tok, ',') ||
+                        isCloseComma(p, tok)))
+      break;  // the fan-out takes these
+    char* word = p->text;
+    int isTemplate;
+    p->text = unquoteArg(p->ast->line, tok, p->text, &isTemplate);
+    cmd->expand |= isTemplate;
+    if (p->inFanOut && endsInComma(p, tok)) {
+      word[strlen(word) - 1] = 0;
+      cmd->argv[cmd->argc++] = word;
+      p->pos++;
+      p->sawComma = TRUE;
+      break;
+    }
+    cmd->argv[cmd->argc++] = word;
+    p->pos++;
+  }
+  if (cmd->argc == 0) {
+    syntaxError(p->ast->line, tok);
+    return -1;
+  }
+  cmd->argv[cmd->argc] = NULL;
+  p->slots += cmd->argc + 1;
+  endNode(p, idx);
+  return idx;
+}
+
+int parseList(Parser* p);
+
+/**
+ * @brief command: ( list ), { list; } or a simple command
+ *
+ * @return int node index, -1 on a syntax error
+ */
+int parseCommand(Parser* p) {
+  Token* tok = peekToken(p);
+  int type;
+  if (tok && tok->type == TOK_LPAREN)
+    type = NODE_SUBSHELL;
+  else if (isKeyword(p, tok, '{'))
+    type = NODE_GROUP;
+  else
+    return parseSimple(p);
+  int start = tok->start;
+  p->pos++;
+  int inFanOut = p->inFanOut;
+  p->inFanOut = FALSE;  // ',' and '}' are ordinary again in there
+  int body = parseList(p);
+  p->inFanOut = inFanOut;
+  if (body < 0)
+    return -1;
+  tok = peekToken(p);
+  if (type == NODE_SUBSHELL ? !tok || tok->type != TOK_RPAREN
+                            : !isKeyword(p, tok, '}')) {
+    syntaxError(p->ast->line, tok);
+    return -1;
+  }
+  p->pos++;
+  int idx = newNode(p, type, start);
+  nodeAt(p, idx)->child = body;
+  while (isRedirect(peekToken(p))) {
+    if (!parseRedirect(p, &nodeAt(p, idx)->cmd))
+      return -1;
+  }
+  endNode(p, idx);
+  return idx;
+}
+
+// how long 'timeout' waits between SIGTERM and SIGKILL unless -k says so
+#define TIMEOUT_GRACE_SECS 5
+
+/**
+ * @brief take a 'timeout [-k grace] duration' prefix off the first command of
+ * a pipeline. The limit then covers the whole pipeline
+ *
+ * @param p the parser
+ * @param pipe the NODE_PIPE
+ * @return boolean FALSE on a usage error
+ */
+int parseTimeout(Parser* p, int pipe) {
+  Node* node = nodeAt(p, pipe);
+  Node* first = nodeAt(p, node->child);
+  char** args = first->cmd.argv;
+  if (first->type != NODE_CMD || !equal(args[0], "timeout"))
+    return TRUE;
+  int skip = 1;
+  node->grace = (struct timespec){TIMEOUT_GRACE_SECS, 0};
+  if (args[1] && equal(args[1], "-k")) {
+    if (!args[2] || !parseDuration(args[2], &node->grace)) {
+      fprintf(stderr, "timeout: -k needs a duration\n");
+      return FALSE;
+    }
+    skip = 3;
+  }
+  if (!args[skip] || !parseDuration(args[skip], &node->limit) ||
+      !args[skip + 1]) {
+    fprintf(stderr, "usage: timeout [-k duration] duration command\n");
+    return FALSE;
+  }
+  node->hasLimit = TRUE;
+  // drop the prefix, the command starts after the duration
+  first->cmd.argv += skip + 1;
+  first->cmd.argc -= skip + 1;
+  return TRUE;
+}
+
+int parsePipeline(Parser* p);
+
+/**
+ * @brief take a '@N' or '@' prefix off a pipeline stage: run N copies of
+ * it (one per CPU for a bare '@') over newline-aligned chunks of its input
+ *
+ * @param p the parser
+ * @param stage the stage's node
+ * @return boolean FALSE on a usage error
+ */
+int parseReplicas(Parser* p, int stage) {
+  Node* node = nodeAt(p, stage);
+  if (node->type != NODE_CMD || node->cmd.argc == 0 ||
+      node->cmd.argv[0][0] != '@')
+    return TRUE;
+  char* count = node->cmd.argv[0] + 1;
+  char* end = count;
+  long n = *count ? strtol(count, &end, 10) : -1;
+  if (*end || n == 0 || n < -1 || n > 1024 || node->cmd.argc < 2) {
+    fprintf(stderr, "usage: @[N] command, N from 1 to 1024\n");
+    return FALSE;
+  }
+  node->cmd.replicas = n;
+  node->cmd.argv++;
+  node->cmd.argc--;
+  return TRUE;
+}
+
+/**
+ * @brief fan-out: '{ pipeline, pipeline ... }' after '|>'. Every consumer
+ * pipeline gets a copy of what the stage before '|>' writes
+ *
+ * @return int the NODE_FANOUT, -1 on a syntax error
+ */
+int parseFanOut(Parser* p) {
+  Token* tok = peekToken(p);
+  if (!isKeyword(p, tok, '{')) {
+    syntaxError(p->ast->line, tok);
+    return -1;
+  }
+  int idx = newNode(p, NODE_FANOUT, tok->start);
+  p->pos++;
+  int inFanOut = p->inFanOut;
+  int closedWithComma = FALSE;
+  int last = -1;
+  while (TRUE) {
+    p->inFanOut = TRUE;
+    p->sawComma = FALSE;
+    int consumer = parsePipeline(p);
+    if (consumer < 0)
+      return -1;
+    if (nodeAt(p, consumer)->hasLimit) {
+      fprintf(stderr, "timeout: a fan-out consumer cannot be limited\n");
+      return -1;
+    }
+    if (last < 0)
+      nodeAt(p, idx)->child = consumer;
+    else
+      nodeAt(p, last)->next = consumer;
+    last = consumer;
+    tok = peekToken(p);
+    if (p->sawComma)
+      continue;
+    if (isKeyword(p, tok, ',')) {
+      p->pos++;
+      continue;
+    }
+    if (isKeyword(p, tok, '}')) {
+      p->pos++;
+      break;
+    }
+    if (inFanOut && isCloseComma(p, tok)) {
+      p->pos++;  // '},' closes a nested fan-out and ends its consumer
+      closedWithComma = TRUE;
+      break;
+    }
+    syntaxError(p->ast->line, tok);
+    return -1;
+  }
+  p->inFanOut = inFanOut;
+  p->sawComma = closedWithComma;
+  endNode(p, idx);
+  return idx;
+}
+
+/**
+ * @brief pipeline: commands separated by '|', optionally ending in a
+ * '|>' fan-out. Runs as one job
+ *
+ * @return int node index, -1 on a syntax error
+ */
+int parsePipeline(Parser* p) {
+  Token* tok = peekToken(p);
+  int idx = newNode(p, NODE_PIPE, tok ? tok->start : 0);
+  int stage = parseCommand(p);
+  if (stage < 0)
+    return -1;
+  nodeAt(p, idx)->child = stage;
+  if (!parseTimeout(p, idx) || !parseReplicas(p, stage))
+    return -1;
+  while (!p->sawComma && (tok = peekToken(p)) && tok->type == TOK_PIPE) {
+    p->pos++;
+    int nextStage = parseCommand(p);
+    if (nextStage < 0 || !parseReplicas(p, nextStage))
+      return -1;
+    nodeAt(p, stage)->next = nextStage;
+    stage = nextStage;
+  }
+  if (!p->sawComma && (tok = peekToken(p)) && tok->type == TOK_FANOUT) {
+    p->pos++;
+    int fanOut = parseFanOut(p);
+    if (fanOut < 0)
+      return -1;
+    nodeAt(p, stage)->next = fanOut;
+  }
+  endNode(p, idx);
+  return idx;
+}
+
+/**
+ * @brief and-or list: pipelines joined by && and ||, left associative
+ *
+ * @return int node index, -1 on a syntax error
+ */
+int parseAndOr(Parser* p) {
+  int left = parsePipeline(p);
+  Token* tok;
+  while (left >= 0 && (tok = peekToken(p)) &&
+         (tok->type == TOK_AND_IF || tok->type == TOK_OR_IF)) {
+    p->pos++;
+    int right = parsePipeline(p);
+    if (right < 0)
+      return -1;
+    int idx = newNode(p, tok->type == TOK_AND_IF ? NODE_AND : NODE_OR,
+                      nodeAt(p, left)->start);
+    nodeAt(p, idx)->child = left;
+    nodeAt(p, left)->next = right;
+    endNode(p, idx);
+    left = idx;
+  }
+  return left;
+}
+
+/**
+ * @brief list: and-or lists ended by ';' or '&', up to the end of the line,
+ * ')' or '}'
+ *
+ * @return int node index, -1 on a syntax error
+ */
+int parseList(Parser* p) {
+  Token* tok = peekToken(p);
+  int idx = newNode(p, NODE_LIST, tok ? tok->start : 0);
+  int last = -1;
+  while ((tok = peekToken(p)) && tok->type != TOK_RPAREN &&
+         !isKeyword(p, tok, '}')) {
+    int item = parseAndOr(p);
+    if (item < 0)
+      return -1;
+    tok = peekToken(p);
+    if (tok && tok->type == TOK_AMP) {
+      if (nodeAt(p, item)->hasLimit) {
+        fprintf(stderr, "timeout: only foreground jobs can be limited\n");
+        return -1;
+      }
+      int bg = newNode(p, NODE_BG, nodeAt(p, item)->start);
+      nodeAt(p, bg)->child = item;
+      nodeAt(p, bg)->len = nodeAt(p, item)->len;  // the job string has no '&'
+      item = bg;
+    }
+    if (last < 0)
+      nodeAt(p, idx)->child = item;
+    else
+      nodeAt(p, last)->next = item;
+    last = item;
+    if (!tok || (tok->type != TOK_AMP && tok->type != TOK_SEMI))
+      break;
+    p->pos++;
+  }
+  if (last < 0) {
+    syntaxError(p->ast->line, tok);
+    return -1;
+  }
+  endNode(p, idx);
+  return idx;
+}
+
+/**
+ * @brief lex and parse a whole line. The nodes, argv arrays and words all
+ * live in the command arena
+ *
+ * @param line the input line
+ * @param ast filled with the parsed line
+ * @return boolean FALSE if the line is empty or has a syntax error
+ */
+int parseLine(const char* line, Ast* ast) {
+  Token* tokens;
+  int numTokens = tokenize(line, &tokens);
+  if (numTokens <= 0)
+    return FALSE;  // empty, or a quote is unterminated
+  size_t textBytes = 0;
+  int numSlots = numTokens + 1;
+  for (int i = 0; i < numTokens; i++) {
+    if (tokens[i].type != TOK_WORD)
+      continue;
+    textBytes += tokens[i].len + 1;
+    if (mayNeedTemplate(line, &tokens[i]))
+      textBytes += tokens[i].len + 1;  // room for a template
+    if (line[tokens[i].start + tokens[i].len - 1] == ',')
+      numSlots++;
+  }
+  Parser p = {ast, tokens, numTokens, 0, 16, NULL, NULL, FALSE, FALSE};
+  // a simple command ends at an operator token, the end of the line or a
+  // fan-out word ending in ',' that is also one of its arguments. One slot
+  // per token, plus one per such word for its NULL, always suffice
+  p.slots = arenaAlloc(&cmdArena, numSlots * sizeof(char*) + textBytes);
+  p.text = (char*)(p.slots + numSlots);
+  ast->line = line;
+  ast->numNodes = 0;
+  ast->nodes = arenaAlloc(&cmdArena, p.capNodes * sizeof(Node));
+  ast->root = parseList(&p);
+  if (ast->root < 0)
+    return FALSE;
+  if (p.pos < numTokens) {
+    syntaxError(line, &tokens[p.pos]);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/**
+ * @brief wait for a freshly started foreground job, with or without a limit
+ *
+ * @param job the job just launched
+ * @param span the node the job runs, holds the 'timeout' limit if any
+ */
+void runForeground(Job* job, Node* span) {
+  if (span->hasLimit)
+    waitForegroundTimed(job, &span->limit, &span->grace);
+  else
+    waitForeground(job);
+}
+
+void runNode(Ast* ast, int idx);
+
+/**
+ * @brief forked subshell: no job control, and the parent's jobs are not ours
+ * to report or resume
+ */
+void enterSubshell() {
+  jobControl = FALSE;
+  // only the forking thread survives fork, start a fresh pool if needed
+  spawnPoolStarted = FALSE;
+  pthread_mutex_init(&spawnLock, NULL);
+  pthread_cond_init(&spawnPosted, NULL);
+  pthread_cond_init(&spawnFinished, NULL);
+  openBuiltinDonePipe();
+  notifyMode = FALSE;
+  stack_base = NULL;
+  stack_top = NULL;
+  plusJob = NULL;
+  dirtyJobs = NULL;
+  numDoneJobs = 0;
+  if (jobTable)
+    memset(jobTable, 0, jobTableCap * sizeof(Job*));
+}
+
+// one running copy of an '@N' stage, working on one chunk of its input
+typedef struct Replica {
+  pid_t pid;     // 0: slot free
+  long seq;      // which chunk, in input order
+  int outFd;     // memfd collecting its output
+  int done;      // exited, output not passed on yet
+  int status;
+} Replica;
+
+// input of an '@N' stage, read ahead up to the next newline
+typedef struct ChunkReader {
+  char* buf;
+  size_t len;
+  size_t cap;
+  int eof;
+} ChunkReader;
+
+/**
+ * @brief cut the next chunk off the input: about parChunk bytes, ending
+ * after a newline. A line longer than that makes a chunk on its own
+ *
+ * @param in the stage's stdin
+ * @param reader read-ahead state
+ * @return int memfd holding the chunk, at offset 0. -1 at the end of the
+ * input or on an error (reported)
+ */
+int nextChunk(int in, ChunkReader* reader) {
+  size_t want = parChunk, cut = 0;
+  while (TRUE) {
+    if (reader->cap < want) {
+      reader->cap = want;
+      reader->buf = realloc(reader->buf, reader->cap);
+    }
+    while (reader->len < want && !reader->eof) {
+      ssize_t n = read(in, reader->buf + reader->len, want - reader->len);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        perror("read");
+      if (n <= 0)
+        reader->eof = TRUE;
+      else
+        reader->len += n;
+    }
+    char* nl = memrchr(reader->buf, '\n', reader->len);
+    if (reader->eof)
+      cut = reader->len;  // an unfinished last line goes along too
+    else if (nl)
+      cut = nl + 1 - reader->buf;
+    if (cut > 0 || reader->eof)
+      break;
+    want *= 2;  // no newline yet: the line continues past the chunk
+  }
+  if (cut == 0)
+    return -1;
+  int fd = memfd_create("yash-chunk", MFD_CLOEXEC);
+  if (fd < 0 || writeFully(fd, reader->buf, cut) || lseek(fd, 0, SEEK_SET)) {
+    perror("chunk");
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  memmove(reader->buf, reader->buf + cut, reader->len - cut);
+  reader->len -= cut;
+  return fd;
+}
+
+/**
+ * @brief start one copy of an '@N' stage on a chunk, its output going to
+ * a fresh memfd. Runs in the stage's process, so the copy lands in the
+ * job's process group
+ *
+ * @param argv its expanded words
+ * @param chunk memfd with the input, closed here
+ * @param slot filled in with the copy. One that could not start is done
+ * right away, with no output
+ * @return boolean FALSE if it could not be started (reported)
+ */
+int startReplica(char* argv[], int chunk, Replica* slot) {
+  slot->pid = 0;
+  slot->done = TRUE;
+  slot->status = 1;
+  slot->outFd = memfd_create("yash-output", MFD_CLOEXEC);
+  if (slot->outFd < 0) {
+    perror("memfd_create");
+    close(chunk);
+    return FALSE;
+  }
+  slot->pid = startChild(argv, chunk, slot->outFd, &slot->status);
+  close(chunk);
+  if (slot->pid < 0) {
+    close(slot->outFd);
+    slot->outFd = -1;
+    slot->pid = 0;
+    return FALSE;
+  }
+  slot->done = FALSE;
+  return TRUE;
+}
+
+/**
+ * @brief body of an '@N' stage: cut stdin into newline-aligned chunks and
+ * run up to N copies of the command at once, one per chunk. Each copy's
+ * output is collected whole and written out when it exits, so lines of
+ * different copies never mix. With 'set -o parorder' the outputs follow
+ * input order, and a finished copy holds its slot until it is its turn
+ *
+ * @param cmd the command
+ * @param argv its expanded words
+ * @return int exit status: 0 if every copy succeeded, otherwise that of the
+ * earliest chunk that failed
+ */
+int runReplicas(Command* cmd, char* argv[]) {
+  int numSlots = cmd->replicas;
+  if (numSlots < 0)
+    numSlots = sysconf(_SC_NPROCESSORS_ONLN) > 0
+                   ? (int)sysconf(_SC_NPROCESSORS_ONLN)
+                   : 1;
+  Replica* slots = calloc(numSlots, sizeof(Replica));
+  ChunkReader reader = {0};
+  long nextSeq = 0, nextOut = 0, failSeq = -1;
+  int status = 0, running = 0;
+  int stop = FALSE;    // no more chunks: a copy failed to start
+  int broken = FALSE;  // output is gone, what is left only gets cleaned up
+  while (TRUE) {
+    for (int i = 0; i < numSlots && !stop && !broken && !reader.eof; i++) {
+      if (slots[i].pid || slots[i].done)
+        continue;
+      int chunk = nextChunk(STDIN_FILENO, &reader);
+      if (chunk < 0)
+        break;
+      slots[i].seq = nextSeq++;
+      if (startReplica(argv, chunk, &slots[i]))
+        running++;
+      else
+        stop = TRUE;
+    }
+
+    int wstatus;
+    pid_t pid = running > 0 ? waitpid(-1, &wstatus, 0) : 0;
+    if (pid < 0 && errno == EINTR)
+      continue;
+    for (int i = 0; i < numSlots && pid > 0; i++) {
+      if (slots[i].pid != pid)
+        continue;
+      slots[i].pid = 0;
+      slots[i].done = TRUE;
+      slots[i].status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus)
+                                           : 128 + WTERMSIG(wstatus);
+      running--;
+    }
+
+    // pass on what may go out now
+    for (int i = 0; i < numSlots; i++) {
+      if (!slots[i].done || (parOrder && slots[i].seq != nextOut))
+        continue;
+      if (slots[i].status && (failSeq < 0 || slots[i].seq < failSeq)) {
+        failSeq = slots[i].seq;
+        status = slots[i].status;
+      }
+      int err = 0;
+      if (slots[i].outFd >= 0) {
+        lseek(slots[i].outFd, 0, SEEK_SET);
+        if (!broken)
+          err = copyFd(slots[i].outFd, STDOUT_FILENO);
+        close(slots[i].outFd);
+      }
+      slots[i].done = FALSE;
+      nextOut++;
+      if (err) {
+        if (err != EPIPE)
+          fprintf(stderr, "@: %s\n", strerror(err));
+        failSeq = 0;
+        status = 1;
+        broken = TRUE;  // nobody reads on: finish up quietly
+        for (int k = 0; k < numSlots; k++) {
+          if (slots[k].pid)
+            kill(slots[k].pid, SIGTERM);
+        }
+      }
+      i = -1;  // the next chunk in order may be waiting in an earlier slot
+    }
+    if (running == 0 && (stop || broken || reader.eof))
+      break;
+  }
+  free(reader.buf);
+  free(slots);
+  return status;
+}
+
+/**
+ * @brief body of a forked pipeline stage, never returns. Runs the builtin,
+ * subshell, group or list the stage stands for (external commands are
+ * spawned, not forked)
+ *
+ * @param ast the parsed line
+ * @param idx the stage's node
+ */
+void runStage(Ast* ast, int idx) {
+  Node* node = &ast->nodes[idx];
+  redirect(&node->cmd);
+  enterSubshell();
+  if (node->type == NODE_CMD && node->cmd.replicas) {
+    lastStatus = runReplicas(&node->cmd, expandArgv(&node->cmd));
+  } else if (node->type == NODE_CMD) {
+    char** argv = expandArgv(&node->cmd);
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    lastStatus = callBuiltin(findBuiltin(argv[0]), argv, fds);
+  }
+  else if (node->type == NODE_SUBSHELL || node->type == NODE_GROUP)
+    runNode(ast, node->child);
+  else
+    runNode(ast, idx);
+  fflush(stdout);
+  _exit(lastStatus);
+}
+
+/**
+ * @brief fork a stage that has to run inside a copy of the shell (builtin,
+ * subshell, group). The child closes every pipe fd but its own two
+ *
+ * @param ast the parsed line
+ * @param stage the stage's node
+ * @param pipes the pipeline's pipes, numPipes of them
+ * @param numPipes number of pipes
+ * @param inFd becomes stdin, -1 to keep the shell's
+ * @param outFd becomes stdout, -1 to keep the shell's
+ * @param leader group to join, 0 to lead a new one
+ * @param foreground whether the job gets the terminal
+ * @return pid_t the child, -1 if fork failed
+ */
+pid_t forkStage(Ast* ast,
+                int stage,
+                int (*pipes)[2],
+                int numPipes,
+                int inFd,
+                int outFd,
+                pid_t leader,
+                int foreground) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (jobControl) {
+      setpgid(0, leader);
+      // take the terminal right away (SIGTTOU is still ignored here): a
+      // stage reading it before yash hands it over would get SIGTTIN
+      if (foreground)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+    resetChildSignals();
+    if (inFd >= 0)
+      dup2(inFd, STDIN_FILENO);
+    if (outFd >= 0)
+      dup2(outFd, STDOUT_FILENO);
+    // no exec will come to close the O_CLOEXEC ends
+    for (int i = 0; i < numPipes; i++) {
+      close(pipes[i][0]);
+      close(pipes[i][1]);
+    }
+    runStage(ast, stage);
+  }
+  if (pid < 0)
+    perror("fork");
+  // set the group from both sides, whichever runs first wins the race
+  else if (jobControl)
+    setpgid(pid, leader ? leader : pid);
+  return pid;
+}
+
+/**
+ * @brief start one process per stage, connected by pipes, all in one new
+ * process group. External commands are spawned, builtins that allow it run
+ * on threads inside the shell, everything else is forked. A fan-out stage
+ * is a thread copying its input into the pipes of all its consumers.
+ * All pipes exist before the first stage starts, and the first stage is
+ * started alone so the pgid is known before any other stage execs. Wide
+ * pipelines then have their external stages spawned by the launcher pool.
+ * The whole pipeline becomes a single job
+ *
+ * @param ast the parsed line
+ * @param stages node index of each stage
+ * @param feeds for each stage, the stage whose output it reads, -1 for none
+ * @param numStages how many stages
+ * @param span node whose text becomes the job string
+ * @param isBackground whether the job starts in the background
+ */
+void executePipeline(Ast* ast,
+                     int stages[],
+                     int feeds[],
+                     int numStages,
+                     Node* span,
+                     int isBackground) {
+  int numPipes = 0;
+  for (int i = 0; i < numStages; i++)
+    numPipes += (feeds[i] >= 0);
+  int(*pipes)[2] = arenaAlloc(&cmdArena, (numPipes + 1) * sizeof(int[2]));
+  int* inFds = arenaAlloc(&cmdArena, numStages * sizeof(int));
+  int* outFds = arenaAlloc(&cmdArena, numStages * sizeof(int));
+  int* feedFds = arenaAlloc(&cmdArena, numStages * sizeof(int));
+  for (int i = 0; i < numStages; i++) {
+    inFds[i] = -1;
+    outFds[i] = -1;
+    feedFds[i] = -1;  // write end of the pipe into stage i
+  }
+  numPipes = 0;
+  for (int i = 0; i < numStages; i++) {
+    if (feeds[i] < 0)
+      continue;
+    // stage feeds[i] => pipes[n][1], pipes[n][0] => stage i
+    int n = numPipes;
+    if (pipe2(pipes[n], O_CLOEXEC) < 0) {
+      perror("pipe");
+      while (n-- > 0) {
+        close(pipes[n][0]);
+        close(pipes[n][1]);
+      }
+      lastStatus = 1;
+      return;
+    }
+    if (pipeSize > 0)
+      fcntl(pipes[n][1], F_SETPIPE_SZ, pipeSize);  // best effort
+    inFds[i] = pipes[n][0];
+    feedFds[i] = pipes[n][1];
+    if (ast->nodes[stages[feeds[i]]].type != NODE_FANOUT)
+      outFds[feeds[i]] = pipes[n][1];  // a fan-out writes all its feedFds
+    numPipes++;
+  }
+
+  pid_t* pids = arenaAlloc(&cmdArena, numStages * sizeof(pid_t));
+  int* failStatus = arenaAlloc(&cmdArena, numStages * sizeof(int));
+  char*** argvs = arenaAlloc(&cmdArena, numStages * sizeof(char**));
+  BuiltinTask** threads = arenaAlloc(&cmdArena, numStages * sizeof(void*));
+  const Builtin** builtinOf = arenaAlloc(&cmdArena, numStages * sizeof(void*));
+  int* onThread = arenaAlloc(&cmdArena, numStages * sizeof(int));
+  int numProcs = 0;
+  for (int i = 0; i < numStages; i++) {
+    Node* node = &ast->nodes[stages[i]];
+    argvs[i] = NULL;
+    builtinOf[i] = NULL;
+    if (node->type == NODE_CMD && !node->cmd.replicas) {
+      argvs[i] = expandArgv(&node->cmd);
+      builtinOf[i] = findBuiltin(argvs[i][0]);
+    }
+    onThread[i] =
+        node->type == NODE_FANOUT ||
+        (builtinOf[i] &&
+         (builtinOf[i]->flags & (BUILTIN_THREAD | BUILTIN_SNAPSHOT)) &&
+         builtinDonePipe[1] >= 0 &&
+         !readsTerminal(builtinOf[i], argvs[i], &node->cmd, i == 0));
+    numProcs += !onThread[i];
+  }
+  // slow builtins only get a thread next to a process: ^C reaches the
+  // process, and its death ends the thread through EOF or EPIPE
+  for (int i = 0; i < numStages && numProcs == 0; i++) {
+    if (builtinOf[i] && (builtinOf[i]->flags & BUILTIN_SLOW)) {
+      onThread[i] = FALSE;
+      numProcs++;
+    }
+  }
+
+  int numSpawns = 0;
+  fflush(stdout);
+  for (int i = 0; i < numStages; i++) {
+    threads[i] = NULL;
+    pids[i] = 0;  // not started yet
+    failStatus[i] = 0;
+    if (ast->nodes[stages[i]].type == NODE_FANOUT) {
+      int numOuts = 0;
+      int* outs = arenaAlloc(&cmdArena, numStages * sizeof(int));
+      for (int j = i + 1; j < numStages; j++) {
+        if (feeds[j] == i)
+          outs[numOuts++] = feedFds[j];
+      }
+      threads[i] = startFanOutStage(inFds[i], outs, numOuts, &failStatus[i]);
+      if (!threads[i])
+        pids[i] = -1;
+    } else if (onThread[i]) {
+      // needs no pgid, so it can start right away
+      threads[i] = startBuiltinStage(builtinOf[i], &ast->nodes[stages[i]].cmd,
+                                     argvs[i], inFds[i], outFds[i],
+                                     &failStatus[i]);
+      if (!threads[i])
+        pids[i] = -1;
+    }
+    if (builtinOf[i])
+      argvs[i] = NULL;  // NULL: not spawned, forked copy of the shell
+    numSpawns += (argvs[i] != NULL);
+  }
+
+  // start stages in order on the shell thread until one leads the group,
+  // then fork the rest of the non-external stages
+  pid_t leader = 0;
+  for (int i = 0; i < numStages; i++) {
+    if (threads[i] || pids[i] < 0)
+      continue;  // running on a thread, or failed to
+    if (leader && argvs[i]) {
+      if (numSpawns >= PARALLEL_SPAWN_MIN)
+        continue;  // the pool starts these below
+    }
+    if (argvs[i]) {
+      pids[i] = spawnCommand(&ast->nodes[stages[i]].cmd, argvs[i], inFds[i],
+                             outFds[i], leader, !isBackground, &failStatus[i]);
+    } else {
+      pids[i] = forkStage(ast, stages[i], pipes, numPipes, inFds[i], outFds[i],
+                          leader, !isBackground);
+      if (pids[i] < 0)
+        failStatus[i] = 1;
+    }
+    if (pids[i] > 0 && !leader) {
+      leader = pids[i];
+#ifndef HAVE_SPAWN_TCSETPGRP
+      // the spawned leader can't take the terminal itself: do it before
+      // the other stages start, so only the leader can race for it
+      if (jobControl && !isBackground && argvs[i])
+        tcsetpgrp(STDIN_FILENO, leader);
+#endif
+    }
+  }
+
+  // the rest of the external stages, concurrently, all joining the leader
+  SpawnTask* tasks = arenaAlloc(&cmdArena, numStages * sizeof(SpawnTask));
+  int numTasks = 0;
+  for (int i = 0; i < numStages; i++) {
+    if (pids[i] || !argvs[i])
+      continue;
+    const char* path = hashCommand(argvs[i][0]);
+    if (!path) {
+      // not on PATH: let spawnCommand report it
+      pids[i] = spawnCommand(&ast->nodes[stages[i]].cmd, argvs[i], -1, -1,
+                             leader, !isBackground, &failStatus[i]);
+      continue;
+    }
+    tasks[numTasks++] = (SpawnTask){path,      &ast->nodes[stages[i]].cmd,
+                                    argvs[i],  inFds[i],
+                                    outFds[i], leader,
+                                    i,         0,
+                                    0};
+  }
+  if (numTasks > 0)
+    spawnParallel(tasks, numTasks);
+  for (int t = 0; t < numTasks; t++) {
+    int i = tasks[t].stage;
+    pids[i] = tasks[t].pid;
+    if (tasks[t].err) {
+      // retry inline: re-resolves a stale path and reports real failures
+      pids[i] = spawnCommand(tasks[t].cmd, tasks[t].argv, tasks[t].inFd,
+                             tasks[t].outFd, leader, !isBackground,
+                             &failStatus[i]);
+    }
+  }
+
+  for (int i = 0; i < numStages; i++) {
+    if (feeds[i] < 0)
+      continue;
+    // builtin threads close the ends they were handed themselves, and a
+    // fan-out all of its outputs
+    if (!threads[i] || threads[i]->fds[0] != inFds[i])
+      close(inFds[i]);
+    BuiltinTask* feeder = threads[feeds[i]];
+    if (ast->nodes[stages[feeds[i]]].type != NODE_FANOUT &&
+        (!feeder || feeder->fds[1] != feedFds[i]))
+      close(feedFds[i]);
+  }
+
+  Job* job = newJob(pids, numStages, isBackground, ast->line + span->start,
+                    span->len);
+  for (int i = 0; i < numStages; i++) {
+    if (pids[i] < 0)
+      job->members[i].status = failStatus[i];
+    if (threads[i] && threads[i]->joined) {
+      job->members[i].status = threads[i]->status;
+      free(threads[i]);
+    } else if (threads[i]) {
+      // done only once the thread has said so
+      job->members[i].state = RUNNING;
+      threads[i]->job = job;
+      threads[i]->stage = i;
+    }
+  }
+  refreshJobStatus(job);
+  if (!isBackground) {
+    runForeground(job, span);  // returns once all ended or one stopped
+  } else if (job->status == DONE) {
+    delJob(job);  // nothing could be started
+  } else {
+    giveUpTerminalRights(job);
+    appendJobToStack(job);
+  }
+}
+
+/**
+ * @brief whether a job on the stack still has a builtin stage on a thread.
+ * An exec would end the thread in the middle of its work
+ *
+ * @return boolean TRUE if one is still running
+ */
+int threadStagesRunning() {
+  for (Job* job = stack_top; job; job = job->prevJob) {
+    for (int i = 0; i < job->numMembers; i++) {
+      if (job->members[i].pid == 0 && job->members[i].state != DONE)
+        return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/**
+ * @brief the last thing 'yash -c' runs: exec the command in place of yash
+ * instead of spawning it and waiting. Never returns
+ *
+ * @param cmd the command
+ * @param argv its expanded words, not a builtin
+ */
+void execTail(Command* cmd, char* argv[]) {
+  const char* path = hashCommand(argv[0]);
+  redirect(cmd);
+  resetChildSignals();
+  signal(SIGPIPE, SIG_DFL);  // yash ignores it
+  fflush(stdout);
+  if (path)
+    execv(path, argv);
+  if (!path || errno == ENOENT) {
+    fprintf(stderr, "%s: command not found\n", argv[0]);
+    _exit(127);
+  }
+  fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+  _exit(126);
+}
+
+/**
+ * @brief list a pipeline's stages in order, each fan-out followed by the
+ * stages of its consumers, along with the stage each one reads from
+ *
+ * @param ast the parsed line
+ * @param idx the NODE_PIPE
+ * @param feed the stage feeding the pipeline's first stage, -1 for none
+ * @param stages filled with node indexes, NULL to only count
+ * @param feeds filled with the feeding stage of each
+ * @param n stages listed so far
+ * @return int stages listed afterwards
+ */
+int flattenPipeline(Ast* ast,
+                    int idx,
+                    int feed,
+                    int stages[],
+                    int feeds[],
+                    int n) {
+  for (int c = ast->nodes[idx].child; c >= 0; c = ast->nodes[c].next) {
+    if (stages) {
+      stages[n] = c;
+      feeds[n] = feed;
+    }
+    feed = n++;
+    if (ast->nodes[c].type != NODE_FANOUT)
+      continue;
+    for (int k = ast->nodes[c].child; k >= 0; k = ast->nodes[k].next)
+      n = flattenPipeline(ast, k, feed, stages, feeds, n);
+  }
+  return n;
+}
+
+/**
+ * @brief run a pipeline as one job. A lone builtin (unless it may run for
+ * long), or a { group } without redirections, runs right inside the shell
+ *
+ * @param ast the parsed line
+ * @param idx the NODE_PIPE
+ * @param isBackground whether it was started with '&'
+ */
+void runPipeline(Ast* ast, int idx, int isBackground) {
+  Node* pipe = &ast->nodes[idx];
+  Node* first = &ast->nodes[pipe->child];
+  if (first->next < 0 && !isBackground && !pipe->hasLimit) {
+    if (first->type == NODE_CMD && !first->cmd.replicas) {
+      char** argv = expandArgv(&first->cmd);
+      const Builtin* builtin = findBuiltin(argv[0]);
+      if (builtin && !(builtin->flags & BUILTIN_SLOW)) {
+        runBuiltinHere(builtin, &first->cmd, argv);
+        return;  // if shell commands finished, skip everything else
+      }
+      if (!builtin && idx == tailPipe && !threadStagesRunning())
+        execTail(&first->cmd, argv);
+    }
+    if (first->type == NODE_GROUP && !first->cmd.inFile &&
+        !first->cmd.outFile && !first->cmd.errFile) {
+      runNode(ast, first->child);
+      return;
+    }
+  }
+  int numStages = flattenPipeline(ast, idx, -1, NULL, NULL, 0);
+  int* stages = arenaAlloc(&cmdArena, numStages * sizeof(int));
+  int* feeds = arenaAlloc(&cmdArena, numStages * sizeof(int));
+  flattenPipeline(ast, idx, -1, stages, feeds, 0);
+  executePipeline(ast, stages, feeds, numStages, pipe, isBackground);
+}
+
+/**
+ * @brief run a node of the parsed line. $? holds the outcome afterwards
+ *
+ * @param ast the parsed line
+ * @param idx the node
+ */
+void runNode(Ast* ast, int idx) {
+  Node* node = &ast->nodes[idx];
+  switch (node->type) {
+    case NODE_LIST:
+      for (int c = node->child; c >= 0 && !lineInterrupted;
+           c = ast->nodes[c].next)
+        runNode(ast, c);
+      break;
+    case NODE_AND:
+    case NODE_OR:
+      runNode(ast, node->child);
+      if (!lineInterrupted && (lastStatus == 0) == (node->type == NODE_AND))
+        runNode(ast, ast->nodes[node->child].next);
+      break;
+    case NODE_BG:
+      if (ast->nodes[node->child].type == NODE_PIPE)
+        runPipeline(ast, node->child, TRUE);
+      else {  // 'a && b &': a forked subshell runs the list as one job
+        int noFeed = -1;
+        executePipeline(ast, &node->child, &noFeed, 1, node, TRUE);
+      }
+      lastStatus = 0;
+      break;
+    case NODE_PIPE:
+      runPipeline(ast, idx, FALSE);
+      break;
+  }
+}
+
+/**
+ * @brief find the pipeline a line runs last, if it is one external command
+ * that may take over the shell's process: the right end of the line's
+ * lists and and-or chains, without a pipe, a 'timeout' or '@N'
+ *
+ * @param ast the parsed line
+ * @param idx node to look into
+ * @return int the NODE_PIPE, -1 if there is none
+ */
+int tailPipeline(Ast* ast, int idx) {
+  Node* node = &ast->nodes[idx];
+  int last = node->child;
+  switch (node->type) {
+    case NODE_LIST:
+    case NODE_AND:
+    case NODE_OR:
+      while (last >= 0 && ast->nodes[last].next >= 0)
+        last = ast->nodes[last].next;
+      return last >= 0 ? tailPipeline(ast, last) : -1;
+    case NODE_PIPE:
+      if (ast->nodes[last].next < 0 && ast->nodes[last].type == NODE_CMD &&
+          !node->hasLimit && !ast->nodes[last].cmd.replicas)
+        return idx;
+  }
+  return -1;
+}
+
+/**
+ * @brief process the input: parse the whole line once (or take its cached
+ * plan), then run it
+ *
+ * @param inputCmd user input
+ */
+void process(char* inputCmd) {
+  unsigned long hash = hashLine(inputCmd);
+  Ast* ast = lookupPlan(inputCmd, hash);
+  if (!ast) {
+    Ast parsed;
+    if (!parseLine(inputCmd, &parsed))
+      return;  // empty line or syntax error
+    ast = cachePlan(&parsed, hash);
+  }
+  lineInterrupted = FALSE;
+  tailPipe = execTailCall ? tailPipeline(ast, ast->root) : -1;
+  runningPlan = ast;
+  runNode(ast, ast->root);
+  runningPlan = NULL;
+}
+
+/**
+ * @brief readline callback, runs once per complete input line
+ *
+ * @param cmd the line (malloc'd by readline), NULL on EOF
+ */
+void handleLine(char* cmd) {
+  if (cmd == NULL) {
+    rl_callback_handler_remove();
+    _exit(0);
+  }
+  if (strlen(cmd) <= 0) {
+    free(cmd);
+    return;
+  }
+  updateJobStack();
+  process(cmd);
+  arenaReset(&cmdArena);
+  free(cmd);
+  reapChildren();
+}
+
+// scripts and piped-in commands are read in blocks of this many bytes
+#define SCRIPT_CHUNK (64 * 1024)
+
+// commands coming from a script file or a pipe instead of a terminal
+typedef struct ScriptReader {
+  int fd;
+  char* buf;
+  size_t start;  // next line begins here
+  size_t len;    // bytes in buf
+  size_t cap;
+  off_t end;     // file offset just past buf, for pread
+  int shared;    // fd is stdin and seekable: commands see the same offset
+  int eof;
+} ScriptReader;
+
+/**
+ * @brief the next line of a script, without its newline. Points into the
+ * reader's buffer and stays valid until the next call
+ *
+ * @param reader the script
+ * @return char* the line, NULL at the end of the script
+ */
+char* nextScriptLine(ScriptReader* reader) {
+  while (TRUE) {
+    char* line = reader->buf + reader->start;
+    size_t avail = reader->len - reader->start;
+    char* nl = memchr(line, '\n', avail);
+    if (nl || (reader->eof && avail > 0)) {
+      size_t lineLen = nl ? (size_t)(nl - line) : avail;
+      line[lineLen] = 0;  // the buffer always keeps a byte spare for this
+      reader->start += lineLen + (nl != NULL);
+      return line;
+    }
+    if (reader->eof)
+      return NULL;
+    // keep the partial line, make room after it and read on
+    memmove(reader->buf, line, avail);
+    reader->start = 0;
+    reader->len = avail;
+    if (reader->cap - reader->len < SCRIPT_CHUNK + 1) {
+      reader->cap = reader->len + SCRIPT_CHUNK + 1;
+      reader->buf = realloc(reader->buf, reader->cap);
+    }
+    ssize_t n = reader->shared
+                    ? pread(reader->fd, reader->buf + reader->len,
+                            SCRIPT_CHUNK, reader->end)
+                    : read(reader->fd, reader->buf + reader->len, SCRIPT_CHUNK);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      perror("read");
+    if (n <= 0) {
+      reader->eof = TRUE;
+      continue;
+    }
+    reader->len += n;
+    reader->end += n;
+  }
+}
+
+/**
+ * @brief run a script, or commands piped into stdin, line by line, never
+ * returns. No readline, no prompt, no job control: everything stays in
+ * yash's process group and the terminal is left alone. When the script is
+ * stdin and a regular file, commands find stdin's offset right after their
+ * own line, like in sh, and whatever they read of the script is skipped
+ *
+ * @param fd the script
+ */
+void runScript(int fd) {
+  struct stat st;
+  ScriptReader reader = {fd};
+  reader.shared = fd == STDIN_FILENO && fstat(fd, &st) == 0 &&
+                  S_ISREG(st.st_mode);
+  if (reader.shared)
+    reader.end = lseek(fd, 0, SEEK_CUR);
+  char* line;
+  while ((line = nextScriptLine(&reader))) {
+    if (!*line)
       continue;
-    updateJobStack(equal(cmd, "jobs"));
-    process(cmd);
-    usleep(1000);  // wait a little so cmd like "ls &" dont print after "# "
-    updateJobStatus();
+    off_t mark = reader.end - (reader.len - reader.start);
+    if (reader.shared)
+      lseek(fd, mark, SEEK_SET);
+    updateJobStack();
+    process(line);
+    arenaReset(&cmdArena);
+    reapChildren();
+    if (reader.shared && lseek(fd, 0, SEEK_CUR) != mark) {
+      // a command read some of the script: go on after what it took
+      reader.start = reader.len = 0;
+      reader.end = lseek(fd, 0, SEEK_CUR);
+    }
+  }
+#ifdef LEAK_CHECK
+  __lsan_do_leak_check();  // _exit() skips LeakSanitizer's own check
+#endif
+  fflush(stdout);
+  _exit(lastStatus);
+}
+
+/**
+ * @brief set up for running a script or 'yash -c': no readline and no
+ * terminal. Like a forked subshell, jobs stay in yash's process group, so
+ * ^C and ^Z act on yash and its jobs alike
+ */
+void startNonInteractive() {
+  jobControl = FALSE;
+  yash = getpid();
+  openBuiltinDonePipe();
+  selectWordScanner();
+}
+
+/**
+ * @brief run 'yash -c string' line by line, never returns. Like a script,
+ * except that an external command ending the string is exec'd, so yash's
+ * process becomes that command. Not while a builtin stage of a background
+ * job still runs on a thread: then the command is spawned and waited for
+ *
+ * @param text the string
+ */
+void runString(char* text) {
+  for (char* line = text; line;) {
+    char* nl = strchr(line, '\n');
+    if (nl)
+      *nl++ = 0;
+    execTailCall = !nl || !nl[strspn(nl, " \t\n")];
+    updateJobStack();
+    process(line);
+    arenaReset(&cmdArena);
+    reapChildren();
+    line = nl;
+  }
+  fflush(stdout);
+  _exit(lastStatus);
+}
+
+int main(int argc, char* argv[]) {
+  signal(SIGTTOU, SIG_IGN);
+  // a builtin thread writing into a closed pipe must get EPIPE, not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  if (argc > 1 && equal(argv[1], "-c")) {
+    if (argc < 3) {
+      fprintf(stderr, "yash: -c: option requires an argument\n");
+      return 2;
+    }
+    startNonInteractive();
+    runString(argv[2]);
+  }
+
+  // 'yash script', or commands that don't come from a terminal
+  int scriptFd = -1;
+  if (argc > 1 && (scriptFd = open(argv[1], O_RDONLY | O_CLOEXEC)) < 0) {
+    perror(argv[1]);
+    return 127;
+  }
+  if (scriptFd < 0 && !isatty(STDIN_FILENO))
+    scriptFd = STDIN_FILENO;
+  if (scriptFd >= 0) {
+    startNonInteractive();
+    runScript(scriptFd);
+  }
+
+  // job control signals are only ever read from sigFd
+  sigset_t jobSignals;
+  sigemptyset(&jobSignals);
+  sigaddset(&jobSignals, SIGCHLD);
+  sigaddset(&jobSignals, SIGINT);
+  sigaddset(&jobSignals, SIGTSTP);
+  sigprocmask(SIG_BLOCK, &jobSignals, NULL);
+  sigFd = signalfd(-1, &jobSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  // give terminal control to yash by default
+  pid_t shell = getpid();
+  setpgid(0, 0);
+  tcsetpgrp(0, shell);
+  yash = shell;
+  foreground = NULL;
+
+  int epollFd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {.events = EPOLLIN};
+  ev.data.fd = STDIN_FILENO;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+  ev.data.fd = sigFd;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, sigFd, &ev);
+  openBuiltinDonePipe();
+  ev.data.fd = builtinDonePipe[0];
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, builtinDonePipe[0], &ev);
+
+  selectWordScanner();
+
+  rl_catch_signals = 0;  // readline must not touch the blocked signals
+  rl_callback_handler_install("# ", handleLine);
+
+  while (TRUE) {
+    struct epoll_event events[3];
+    int n = epoll_wait(epollFd, events, 3, -1);
+    if (n < 0 && errno != EINTR)
+      break;
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == sigFd) {
+        handleSignals();
+      } else if (events[i].data.fd == builtinDonePipe[0]) {
+        reapBuiltinThreads();
+        if (notifyMode)
+          notifyDoneJobs();
+      } else {
+        rl_callback_read_char();
+      }
+    }
   }
-}
\ No newline at end of file
+  rl_callback_handler_remove();
+  return 1;
+}